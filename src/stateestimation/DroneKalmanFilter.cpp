@@ -963,6 +963,21 @@ TooN::Vector<10> DroneKalmanFilter::getPoseAtAsVec(int timestamp, bool useContro
 
 }
 
+// same as getPoseAtAsVec, but also gives the predicted pose variances
+// (these grow over the prediction interval, the current ones don't).
+TooN::Vector<10> DroneKalmanFilter::getPoseAndVarianceAtAsVec(int timestamp, TooN::Vector<6> &poseVariances, bool useControlGains)
+{
+	// make shallow copy
+	DroneKalmanFilter scopy = DroneKalmanFilter(*this);
+
+	// predict using this copy
+	scopy.predictUpTo(timestamp,false, useControlGains);
+
+	// return values, and discard any changes made to scopy (deleting it)
+	poseVariances = scopy.getCurrentPoseVariances();
+	return scopy.getCurrentPoseSpeedAsVec();
+}
+
 bool DroneKalmanFilter::handleCommand(std::string s)
 {
 
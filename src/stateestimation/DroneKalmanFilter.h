@@ -416,6 +416,7 @@ public:
 	void addFakePTAMObservation(int time);
 	tum_ardrone::filter_state getPoseAt(ros::Time t, bool useControlGains = true);
 	TooN::Vector<10> getPoseAtAsVec(int timestamp, bool useControlGains = true);
+	TooN::Vector<10> getPoseAndVarianceAtAsVec(int timestamp, TooN::Vector<6> &poseVariances, bool useControlGains = true);
 
 };
 #endif /* __DRONEKALMANFILTER_H */
@@ -0,0 +1,143 @@
+#include "CompressedImage.h"
+#include "ImagePool.h"
+
+using namespace CVD;
+using namespace std;
+
+// Prediction errors are packed in blocks of this many pixels.
+static const int nBlockSize = 16;
+
+// The LOCO-I median edge detector: a is the left, b the upper
+// and c the upper-left neighbour.
+static inline int PredictPixel(int a, int b, int c)
+{
+  int nMin = a < b ? a : b;
+  int nMax = a < b ? b : a;
+  if(c >= nMax)
+    return nMin;
+  if(c <= nMin)
+    return nMax;
+  return a + b - c;
+}
+
+// Prediction of pixel x of a row; the first row and column, which
+// lack neighbours, just use the one which is there.
+static inline int PredictInRow(const byte *pRow, const byte *pAbove, int x)
+{
+  if(pAbove == NULL)
+    return x == 0 ? 0 : pRow[x-1];
+  if(x == 0)
+    return pAbove[0];
+  return PredictPixel(pRow[x-1], pAbove[x], pAbove[x-1]);
+}
+
+// Errors are taken modulo 256 and interleaved by sign, so that small
+// errors of either sign become small numbers: 0,-1,1,-2,.. -> 0,1,2,3,..
+static inline byte ZigZag(int nError)
+{
+  signed char e = (signed char) nError;
+  return (byte) ((e << 1) ^ (e >> 7));
+}
+
+static inline int UnZigZag(byte z)
+{
+  return (z >> 1) ^ -(z & 1);
+}
+
+CompressedImage::CompressedImage()
+{
+  mirSize = ImageRef(0,0);
+}
+
+void CompressedImage::Clear()
+{
+  mirSize = ImageRef(0,0);
+  vector<unsigned char>().swap(mvData);
+}
+
+void CompressedImage::Compress(const BasicImage<byte> &im)
+{
+  mirSize = im.size();
+  mvData.clear();
+  mvData.reserve(mirSize.area() / 2 + 64);
+  
+  const int nWidth = mirSize.x;
+  const int nPadded = (nWidth + nBlockSize - 1) / nBlockSize * nBlockSize;
+  vector<byte> vErrors(nPadded, 0);
+  
+  for(int y=0; y<mirSize.y; y++)
+    {
+      const byte *pRow = im[y];
+      const byte *pAbove = y == 0 ? NULL : im[y-1];
+      for(int x=0; x<nWidth; x++)
+	vErrors[x] = ZigZag(pRow[x] - PredictInRow(pRow, pAbove, x));
+      
+      for(int nBlock=0; nBlock<nPadded; nBlock+=nBlockSize)
+	{
+	  const byte *pBlock = &vErrors[nBlock];
+	  byte nOr = 0;
+	  for(int i=0; i<nBlockSize; i++)
+	    nOr |= pBlock[i];
+	  int nBits = 0;
+	  while(nOr >> nBits)
+	    nBits++;
+	  
+	  // A header byte with the bit width, then 2*nBits bytes of packed errors.
+	  mvData.push_back((unsigned char) nBits);
+	  unsigned int nAccum = 0;
+	  int nAccumBits = 0;
+	  for(int i=0; i<nBlockSize && nBits>0; i++)
+	    {
+	      nAccum |= pBlock[i] << nAccumBits;
+	      nAccumBits += nBits;
+	      while(nAccumBits >= 8)
+		{
+		  mvData.push_back((unsigned char) (nAccum & 0xff));
+		  nAccum >>= 8;
+		  nAccumBits -= 8;
+		}
+	    }
+	}
+      // The padding at the row end stays zero for the next row.
+    }
+  
+  vector<unsigned char>(mvData).swap(mvData);   // Don't keep the slack of reserve()
+}
+
+void CompressedImage::Decompress(Image<byte> &im) const
+{
+  ImagePool<byte>::Instance().Resize(im, mirSize);
+  
+  const int nWidth = mirSize.x;
+  const int nPadded = (nWidth + nBlockSize - 1) / nBlockSize * nBlockSize;
+  vector<byte> vErrors(nPadded, 0);
+  const unsigned char *pData = mvData.empty() ? NULL : &mvData[0];
+  
+  for(int y=0; y<mirSize.y; y++)
+    {
+      for(int nBlock=0; nBlock<nPadded; nBlock+=nBlockSize)
+	{
+	  byte *pBlock = &vErrors[nBlock];
+	  const int nBits = *pData++;
+	  const unsigned int nMask = (1 << nBits) - 1;
+	  unsigned int nAccum = 0;
+	  int nAccumBits = 0;
+	  for(int i=0; i<nBlockSize; i++)
+	    {
+	      while(nAccumBits < nBits)
+		{
+		  nAccum |= *pData++ << nAccumBits;
+		  nAccumBits += 8;
+		}
+	      pBlock[i] = (byte) (nAccum & nMask);
+	      nAccum >>= nBits;
+	      nAccumBits -= nBits;
+	    }
+	}
+      
+      byte *pRow = im[y];
+      const byte *pAbove = y == 0 ? NULL : im[y-1];
+      for(int x=0; x<nWidth; x++)
+	pRow[x] = (byte) (PredictInRow(pRow, pAbove, x) + UnZigZag(vErrors[x]));
+    }
+}
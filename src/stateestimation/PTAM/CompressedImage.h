@@ -0,0 +1,35 @@
+// -*- c++ -*-
+//
+// CompressedImage.h
+//
+// Lossless compression of greyscale images, used as cold storage for
+// the pyramid levels of keyframes which haven't been used for a while
+// (see KeyFrame::CompressImages.) Speed matters more than the ratio:
+// each pixel is predicted from its left, upper and upper-left neighbours
+// (the LOCO-I median predictor), and the prediction errors are bit-packed
+// in blocks of 16 with the smallest bit width which holds the block.
+
+#ifndef __COMPRESSEDIMAGE_H
+#define __COMPRESSEDIMAGE_H
+#include <cvd/image.h>
+#include <cvd/byte.h>
+#include <vector>
+
+class CompressedImage
+{
+public:
+  CompressedImage();
+  
+  void Compress(const CVD::BasicImage<CVD::byte> &im);
+  void Decompress(CVD::Image<CVD::byte> &im) const;   // im is (re-)sized through the ImagePool
+  void Clear();
+  
+  inline CVD::ImageRef Size() const { return mirSize; }
+  inline size_t Bytes() const { return mvData.size(); }
+  
+protected:
+  CVD::ImageRef mirSize;
+  std::vector<unsigned char> mvData;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "ImagePool.h"
+#include "settingsCustom.h"
+#include <TooN/TooN.h>
+#include <cvd/byte.h>
+#include <gvars3/instances.h>
+
+using namespace CVD;
+using namespace TooN;
+using namespace std;
+using namespace GVars3;
+
+template<class T>
+ImagePool<T> &ImagePool<T>::Instance()
+{
+  // Never deleted, so images which are released during static
+  // destruction still find their pool.
+  static ImagePool *pPool = new ImagePool;
+  return *pPool;
+}
+
+template<class T>
+ImagePool<T>::ImagePool()
+{
+  static gvar3<int> gvnMaxPerSize("ImagePool.MaxPerSize", IMAGE_POOL_MAX_PER_SIZE_DEFAULT, SILENT);
+  mnMaxPerSize = *gvnMaxPerSize;
+  mStats.nHits = mStats.nMisses = mStats.nReleases = mStats.nDiscards = 0;
+  mStats.nPooled = mStats.nPooledHighWater = 0;
+  mStats.nBytesPooled = mStats.nBytesPooledHighWater = 0;
+  pthread_mutex_init(&mMutex, NULL);
+}
+
+template<class T>
+void ImagePool<T>::Resize(Image<T> &im, ImageRef irSize)
+{
+  if(im.size() == irSize)
+    {
+      // Same as Image::resize, the result mustn't share pixels with another image;
+      // but the pixels are about to be overwritten, so there's no need to copy them.
+      if(im.data() != NULL)
+	im.resize(irSize);
+      return;
+    }
+  
+  Release(im);
+  if(irSize.x <= 0 || irSize.y <= 0)
+    {
+      im = Image<T>(irSize);  // Not im.resize(), which can't cope with an empty im.
+      return;
+    }
+  
+  pthread_mutex_lock(&mMutex);
+  vector<Image<T> > &vFree = mmFree[SizeClass(irSize.x, irSize.y)];
+  if(vFree.empty())
+    {
+      mStats.nMisses++;
+      pthread_mutex_unlock(&mMutex);
+      im.resize(irSize);   // Allocate outside the lock.
+      return;
+    }
+  im = vFree.back();
+  vFree.pop_back();
+  mStats.nHits++;
+  mStats.nPooled--;
+  mStats.nBytesPooled -= irSize.area() * sizeof(T);
+  pthread_mutex_unlock(&mMutex);
+}
+
+template<class T>
+void ImagePool<T>::Release(Image<T> &im)
+{
+  if(im.data() == NULL)
+    return;
+  // Never pool pixels which some other image still uses: just let go of those.
+  // libcvd has no way of asking whether a buffer is shared, but resize() to the
+  // same size leaves a buffer of one's own alone and swaps a shared one for a
+  // fresh, uncopied one, so that tells.
+  const T *pData = im.data();
+  im.resize(im.size());
+  if(im.data() != pData)
+    {
+      im = Image<T>();
+      return;
+    }
+  
+  ImageRef irSize = im.size();
+  pthread_mutex_lock(&mMutex);
+  mStats.nReleases++;
+  vector<Image<T> > &vFree = mmFree[SizeClass(irSize.x, irSize.y)];
+  if(vFree.size() < mnMaxPerSize)
+    {
+      vFree.push_back(im);
+      mStats.nPooled++;
+      mStats.nBytesPooled += irSize.area() * sizeof(T);
+      if(mStats.nPooled > mStats.nPooledHighWater)
+	mStats.nPooledHighWater = mStats.nPooled;
+      if(mStats.nBytesPooled > mStats.nBytesPooledHighWater)
+	mStats.nBytesPooledHighWater = mStats.nBytesPooled;
+    }
+  else
+    mStats.nDiscards++;
+  pthread_mutex_unlock(&mMutex);
+  
+  im = Image<T>();  // A discarded buffer is freed here, outside the lock.
+}
+
+template<class T>
+ImagePoolStats ImagePool<T>::GetStats()
+{
+  pthread_mutex_lock(&mMutex);
+  ImagePoolStats stats = mStats;
+  pthread_mutex_unlock(&mMutex);
+  return stats;
+}
+
+// The pixel types which use pools:
+template class ImagePool<byte>;
+template class ImagePool<short>;
+template class ImagePool<unsigned int>;
+template class ImagePool<float>;
+template class ImagePool<Vector<2> >;
+template class ImagePool<pair<float,float> >;
+
+static void PrintStats(ostream &os, const char *szName, const ImagePoolStats &stats)
+{
+  os << "  ImagePool<" << szName << ">: " << stats.nHits << " hits, " << stats.nMisses << " misses, "
+     << stats.nReleases << " releases, " << stats.nDiscards << " discards; "
+     << stats.nPooled << " buffers (" << stats.nBytesPooled << " bytes) pooled, high-water "
+     << stats.nPooledHighWater << " (" << stats.nBytesPooledHighWater << " bytes)" << endl;
+}
+
+void PrintImagePoolStats(ostream &os)
+{
+  PrintStats(os, "byte", ImagePool<byte>::Instance().GetStats());
+  PrintStats(os, "short", ImagePool<short>::Instance().GetStats());
+  PrintStats(os, "unsigned int", ImagePool<unsigned int>::Instance().GetStats());
+  PrintStats(os, "float", ImagePool<float>::Instance().GetStats());
+  PrintStats(os, "Vector<2>", ImagePool<Vector<2> >::Instance().GetStats());
+  PrintStats(os, "pair<float,float>", ImagePool<pair<float,float> >::Instance().GetStats());
+}
@@ -0,0 +1,62 @@
+// -*- c++ -*-
+//
+// ImagePool.h
+//
+// A thread-safe pool of CVD image buffers. The pyramid levels, small
+// blurry images and patch templates are made and dropped over and over
+// again; drawing their buffers from a pool re-uses the same few blocks
+// of memory instead of going back to the heap every time.
+//
+// Buffers are kept in size classes by their exact image size: a CVD
+// image can't change shape, and only a handful of sizes are ever used.
+// Resize() is a stand-in for CVD::Image::resize() which gives the old
+// buffer back to the pool and takes the new one from it; Release()
+// gives a buffer back when its owner is done with it. Each size class
+// holds at most ImagePool.MaxPerSize idle buffers, extra ones are freed.
+//
+// There is one pool per pixel type, reached through Instance().
+
+#ifndef __IMAGEPOOL_H
+#define __IMAGEPOOL_H
+#include <cvd/image.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <utility>
+#include <ostream>
+
+struct ImagePoolStats
+{
+  unsigned long nHits;         // Requests served with a pooled buffer
+  unsigned long nMisses;       // Requests which had to allocate
+  unsigned long nReleases;     // Buffers given back
+  unsigned long nDiscards;     // Buffers given back but freed, since their class was full
+  unsigned int nPooled;        // Idle buffers held right now..
+  unsigned int nPooledHighWater;    // .. and the most ever held at once
+  size_t nBytesPooled;
+  size_t nBytesPooledHighWater;
+};
+
+template<class T>
+class ImagePool
+{
+public:
+  static ImagePool &Instance();
+  
+  void Resize(CVD::Image<T> &im, CVD::ImageRef irSize);   // Like im.resize(irSize), but via the pool
+  void Release(CVD::Image<T> &im);                        // Gives im's buffer to the pool; im is left empty
+  ImagePoolStats GetStats();
+  
+protected:
+  ImagePool();
+  
+  typedef std::pair<int,int> SizeClass;
+  std::map<SizeClass, std::vector<CVD::Image<T> > > mmFree;   // Idle buffers of each size
+  unsigned int mnMaxPerSize;
+  ImagePoolStats mStats;
+  pthread_mutex_t mMutex;
+};
+
+void PrintImagePoolStats(std::ostream &os);   // Statistics of all pools, one line each
+
+#endif
@@ -2,8 +2,12 @@
 #include "KeyFrame.h"
 #include "ShiTomasi.h"
 #include "SmallBlurryImage.h"
+#include "WorkerPool.h"
+#include "ImagePool.h"
 #include <cvd/vision.h>
 #include <cvd/fast_corner.h>
+#include <cstring>
+#include <pthread.h>
 
 #include "settingsCustom.h"
 
@@ -11,6 +15,243 @@ using namespace CVD;
 using namespace std;
 using namespace GVars3;
 
+// Parameters of the pyramid levels, one row per level.
+// I use a different FAST threshold on each level; this is a bit of a hack whose aim is to 
+// balance the different levels' relative feature densities. The colours are what the
+// levels' features are drawn in (gavLevelColors, see below.)
+struct LevelParams
+{
+  int nFASTThreshold;
+  double adColor[3];
+};
+static const LevelParams gaLevelParams[] =
+  {
+    {10, {1.0, 0.0, 0.0}},
+    {15, {1.0, 1.0, 0.0}},
+    {15, {0.0, 1.0, 0.0}},
+    {10, {0.0, 0.0, 0.7}}
+  };
+// Doesn't compile unless the table has exactly LEVELS rows:
+typedef char LevelParamsNeedsOneRowPerLevel[sizeof(gaLevelParams) / sizeof(gaLevelParams[0]) == LEVELS ? 1 : -1];
+
+// MakeKeyFrame_Lite works through the image in bands of this many level-zero rows.
+// Must be a multiple of 16 (see below.)
+static const int KF_LITE_BAND_ROWS = 32;
+
+// Detects the FAST corners in rows [nStart, nEnd) of a pyramid level image and appends 
+// them to vCorners. A FAST corner needs three rows either side, which must be present 
+// in the image. The corners of a band of rows are exactly those which fast_corner_detect_10 
+// finds in these rows when run on the whole image, and in the same (row-major) order.
+static void DetectCornersInRows(Image<byte> &im, int nThreshold, int nStart, int nEnd, vector<ImageRef> &vCorners)
+{
+  int nTop = max(0, nStart - 3);
+  int nBottom = min(im.size().y, nEnd + 3);
+  BasicImage<byte> imBand(im[nTop], ImageRef(im.size().x, nBottom - nTop));
+  
+  unsigned int nFirst = vCorners.size();
+  fast_corner_detect_10(imBand, vCorners, nThreshold);
+  for(unsigned int i=nFirst; i<vCorners.size(); i++)
+    vCorners[i].y += nTop;
+}
+
+// Extends the row look-up-table for the FAST corner points up to row nEnd:
+// this speeds up finding close-by corner points later on.
+static void ExtendRowLUT(Level &lev, int nEnd)
+{
+  unsigned int v = lev.vCornerRowLUT.empty() ? 0 : lev.vCornerRowLUT.back();
+  for(int y=lev.vCornerRowLUT.size(); y<nEnd; y++)
+    {
+      while(v < lev.vCorners.size() && y > lev.vCorners[v].y)
+	v++;
+      lev.vCornerRowLUT.push_back(v);
+    }
+}
+
+// Sorts the FAST corners of a level into its bucket grid; a counting sort, so
+// the corners of each cell stay in the order of vCorners.
+static void MakeCornerGrid(Level &lev)
+{
+  lev.nCornerGridWidth = (lev.im.size().x + CORNER_GRID_CELL_SIZE - 1) / CORNER_GRID_CELL_SIZE;
+  lev.nCornerGridHeight = (lev.im.size().y + CORNER_GRID_CELL_SIZE - 1) / CORNER_GRID_CELL_SIZE;
+  vector<int> &vStart = lev.vCornerGridStart;
+  vStart.assign(lev.nCornerGridWidth * lev.nCornerGridHeight + 1, 0);
+  
+  for(unsigned int i=0; i<lev.vCorners.size(); i++)
+    {
+      const ImageRef &ir = lev.vCorners[i];
+      vStart[(ir.y / CORNER_GRID_CELL_SIZE) * lev.nCornerGridWidth + ir.x / CORNER_GRID_CELL_SIZE + 1]++;
+    }
+  for(unsigned int c=1; c<vStart.size(); c++)
+    vStart[c] += vStart[c-1];
+  
+  vector<int> vNext(vStart.begin(), vStart.end() - 1);
+  lev.vCornerGridIndex.resize(lev.vCorners.size());
+  for(unsigned int i=0; i<lev.vCorners.size(); i++)
+    {
+      const ImageRef &ir = lev.vCorners[i];
+      lev.vCornerGridIndex[vNext[(ir.y / CORNER_GRID_CELL_SIZE) * lev.nCornerGridWidth + ir.x / CORNER_GRID_CELL_SIZE]++] = i;
+    }
+}
+
+// Fills in the integral image rows of level image rows [nStart, nEnd); the rows
+// above must have been done already.
+static void MakeIntegralRows(Level &lev, int nStart, int nEnd)
+{
+  const int nWidth = lev.im.size().x;
+  for(int y=nStart; y<nEnd; y++)
+    {
+      const byte *pIm = lev.im[y];
+      const unsigned int *pSumAbove = lev.imSum[y];
+      const unsigned int *pSumSqAbove = lev.imSumSq[y];
+      unsigned int *pSum = lev.imSum[y+1];
+      unsigned int *pSumSq = lev.imSumSq[y+1];
+      unsigned int nRowSum = 0;
+      unsigned int nRowSumSq = 0;
+      pSum[0] = pSumSq[0] = 0;
+      for(int x=0; x<nWidth; x++)
+	{
+	  unsigned int n = pIm[x];
+	  nRowSum += n;
+	  nRowSumSq += n * n;
+	  pSum[x+1] = pSumAbove[x+1] + nRowSum;
+	  pSumSq[x+1] = pSumSqAbove[x+1] + nRowSumSq;
+	}
+    }
+}
+
+// Finds the maximal FAST corners in rows [nStart, nEnd) of a level (into vMaxCorners),
+// and appends those with a suitably high Shi-Tomasi score to vCandidates, i.e. points which
+// the mapmaker will attempt to make new map points out of. The nonmax suppression of a
+// row only looks at the rows above and below, so a band of rows gives the same as the
+// corresponding part of the whole level.
+static void FindCandidatesInRows(Level &lev, int nStart, int nEnd, double dMinSTScore,
+				 vector<ImageRef> &vMaxCorners, vector<Candidate> &vCandidates)
+{
+  int nHeight = lev.im.size().y;
+  if(nStart == 0 && nEnd == nHeight)
+    fast_nonmax(lev.im, lev.vCorners, 10, vMaxCorners);
+  else
+    {
+      int nFirst = lev.vCornerRowLUT[max(0, nStart - 1)];
+      int nLast = (nEnd + 1 < nHeight) ? lev.vCornerRowLUT[nEnd + 1] : lev.vCorners.size();
+      vector<ImageRef> vCorners(lev.vCorners.begin() + nFirst, lev.vCorners.begin() + nLast);
+      fast_nonmax(lev.im, vCorners, 10, vMaxCorners);
+      
+      // Only keep the band's own rows.
+      unsigned int a = 0;
+      while(a < vMaxCorners.size() && vMaxCorners[a].y < nStart)
+	a++;
+      unsigned int b = a;
+      while(b < vMaxCorners.size() && vMaxCorners[b].y < nEnd)
+	b++;
+      vMaxCorners.erase(vMaxCorners.begin() + b, vMaxCorners.end());
+      vMaxCorners.erase(vMaxCorners.begin(), vMaxCorners.begin() + a);
+    }
+  
+  // Score all maximal corners clear of the border in one batch.
+  vector<ImageRef> vToScore;
+  vToScore.reserve(vMaxCorners.size());
+  for(vector<ImageRef>::iterator i=vMaxCorners.begin(); i!=vMaxCorners.end(); i++)
+    if(lev.im.in_image_with_border(*i, 10))
+      vToScore.push_back(*i);
+  
+  vector<double> vdSTScores;
+  FindShiTomasiScores(lev.im, 3, vToScore, vdSTScores);
+  for(unsigned int i=0; i<vToScore.size(); i++)
+    if(vdSTScores[i] > dMinSTScore)
+      {
+	Candidate c;
+	c.irLevelPos = vToScore[i];
+	c.dSTScore = vdSTScores[i];
+	vCandidates.push_back(c);
+      }
+}
+
+// Makes a worker pool on first use, with as many threads as the named GVar says;
+// NULL if that is zero.
+static WorkerPool *GetWorkerPool(WorkerPool *&pPool, bool &bMade, const char *szThreadsName, int nDefault)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&mutex);
+  if(!bMade)
+    {
+      int nThreads = GV3::get<int>(szThreadsName, nDefault, SILENT);
+      if(nThreads > 0)
+	pPool = new WorkerPool(nThreads);
+      bMade = true;
+    }
+  pthread_mutex_unlock(&mutex);
+  return pPool;
+}
+
+// The tracker's pool, for keyframe creation: KeyFrame.WorkerThreads threads.
+WorkerPool *KeyFrameWorkerPool()
+{
+  static WorkerPool *pPool = NULL;
+  static bool bMade = false;
+  return GetWorkerPool(pPool, bMade, "KeyFrame.WorkerThreads", KEYFRAME_WORKER_THREADS_DEFAULT);
+}
+
+// The mapmaker's pool, for its keyframes and re-finding: MapMaker.WorkerThreads threads.
+// Kept apart from the tracker's, so the mapmaker's long jobs never queue up ahead of
+// the tracker's per-frame ones.
+WorkerPool *MapMakerWorkerPool()
+{
+  static WorkerPool *pPool = NULL;
+  static bool bMade = false;
+  return GetWorkerPool(pPool, bMade, "MapMaker.WorkerThreads", MAPMAKER_WORKER_THREADS_DEFAULT);
+}
+
+// Jobs for the worker pool: each works on a band of rows of one level, and keeps its
+// results to itself; they are merged in order of the jobs afterwards, which keeps 
+// everything in row order.
+struct DetectCornersJob : public Runnable
+{
+  DetectCornersJob(Level &lev, int nThreshold, int nStart, int nEnd)
+    : pLevel(&lev), nThreshold(nThreshold), nStart(nStart), nEnd(nEnd) {}
+  virtual void run() { DetectCornersInRows(pLevel->im, nThreshold, nStart, nEnd, vCorners); }
+  
+  Level *pLevel;
+  int nThreshold;
+  int nStart, nEnd;
+  vector<ImageRef> vCorners;
+};
+
+struct FindCandidatesJob : public Runnable
+{
+  FindCandidatesJob(Level &lev, int nStart, int nEnd, double dMinSTScore)
+    : pLevel(&lev), nStart(nStart), nEnd(nEnd), dMinSTScore(dMinSTScore) {}
+  virtual void run() { FindCandidatesInRows(*pLevel, nStart, nEnd, dMinSTScore, vMaxCorners, vCandidates); }
+  
+  Level *pLevel;
+  int nStart, nEnd;
+  double dMinSTScore;
+  vector<ImageRef> vMaxCorners;
+  vector<Candidate> vCandidates;
+};
+
+// Level zero has about three quarters of the work, so it is split into one
+// band per thread (including the calling one); the smaller levels are one job each.
+template<class Job> static void AddBandJobs(vector<Job> &vJobs, Level &lev, int nBands, const Job &proto)
+{
+  int nHeight = lev.im.size().y;
+  for(int i=0; i<nBands; i++)
+    {
+      Job job = proto;
+      job.nStart = nHeight * i / nBands;
+      job.nEnd = nHeight * (i + 1) / nBands;
+      vJobs.push_back(job);
+    }
+}
+
+template<class Job> static void RunJobs(WorkerPool &pool, vector<Job> &vJobs)
+{
+  vector<Runnable*> vpJobs;
+  for(unsigned int i=0; i<vJobs.size(); i++)
+    vpJobs.push_back(&vJobs[i]);
+  pool.Run(vpJobs);
+}
+
 void KeyFrame::MakeKeyFrame_Lite(BasicImage<byte> &im)
 {
   // Perpares a Keyframe from an image. Generates pyramid levels, does FAST detection, etc.
@@ -18,78 +259,156 @@ void KeyFrame::MakeKeyFrame_Lite(BasicImage<byte> &im)
   // e.g. does not perform FAST nonmax suppression. Things like that which are needed by the 
   // mapmaker but not the tracker go in MakeKeyFrame_Rest();
   
-  // First, copy out the image data to the pyramid's zero level.
-  aLevels[0].im.resize(im.size());
-  copy(im, aLevels[0].im);
-
-  // Then, for each level...
+  // Rather than making each whole level and then searching it for corners, the levels
+  // are filled in bands of rows, top to bottom: each band of the input image is copied
+  // to level zero, half-sampled into the next levels, and searched for corners while it's
+  // still in the cache. Bands start at multiples of 16 rows, so halfSample takes the same
+  // (SSE or plain) code path on them as on the whole image: the pyramid and corners are
+  // identical to those of doing one level after the other.
+  static gvar3<int> gvnIntegralImages("KeyFrame.IntegralImages", KEYFRAME_INTEGRAL_IMAGES_DEFAULT, SILENT);
+  bool bIntegrals = *gvnIntegralImages != 0;
+  
+  int anRowsMade[LEVELS];       // Rows of each level image filled in so far
+  int anRowsDetected[LEVELS];   // Rows of each level searched for corners so far
+  int anRowsSummed[LEVELS];     // Rows of each level in the integral images so far
   for(int i=0; i<LEVELS; i++)
     {
       Level &lev = aLevels[i];
-      if(i!=0)
-	{  // .. make a half-size image from the previous level..
-	  lev.im.resize(aLevels[i-1].im.size() / 2);
-	  halfSample(aLevels[i-1].im, lev.im);
-	}
-      
-      // .. and detect and store FAST corner points.
-      // I use a different threshold on each level; this is a bit of a hack
-      // whose aim is to balance the different levels' relative feature densities.
+      ImagePool<byte>::Instance().Resize(lev.im, i==0 ? im.size() : aLevels[i-1].im.size() / 2);
       lev.vCorners.clear();
       lev.vCandidates.clear();
       lev.vMaxCorners.clear();
-      if(i == 0)
-	fast_corner_detect_10(lev.im, lev.vCorners, 10);
-      if(i == 1)
-	fast_corner_detect_10(lev.im, lev.vCorners, 15);
-      if(i == 2)
-	fast_corner_detect_10(lev.im, lev.vCorners, 15);
-      if(i == 3)
-	fast_corner_detect_10(lev.im, lev.vCorners, 10);
-      
-      // Generate row look-up-table for the FAST corner points: this speeds up 
-      // finding close-by corner points later on.
-      unsigned int v=0;
       lev.vCornerRowLUT.clear();
-      for(int y=0; y<lev.im.size().y; y++)
+      anRowsMade[i] = anRowsDetected[i] = anRowsSummed[i] = 0;
+      
+      lev.bIntegralsMade = bIntegrals;
+      if(bIntegrals)
+	{
+	  ImageRef irSumSize = lev.im.size() + ImageRef(1,1);
+	  ImagePool<unsigned int>::Instance().Resize(lev.imSum, irSumSize);
+	  ImagePool<unsigned int>::Instance().Resize(lev.imSumSq, irSumSize);
+	  memset(lev.imSum[0], 0, irSumSize.x * sizeof(unsigned int));
+	  memset(lev.imSumSq[0], 0, irSumSize.x * sizeof(unsigned int));
+	}
+    }
+  
+  // With worker threads, the pyramid is made first, and then the corners of all
+  // levels are detected in parallel.
+  WorkerPool *pPool = KeyFrameWorkerPool();
+  if(pPool)
+    {
+      copy(im, aLevels[0].im);
+      for(int i=1; i<LEVELS; i++)
+	halfSample(aLevels[i-1].im, aLevels[i].im);
+      if(bIntegrals)
+	for(int i=0; i<LEVELS; i++)
+	  MakeIntegralRows(aLevels[i], 0, aLevels[i].im.size().y);
+      
+      vector<DetectCornersJob> vJobs;
+      AddBandJobs(vJobs, aLevels[0], pPool->NumThreads() + 1, DetectCornersJob(aLevels[0], gaLevelParams[0].nFASTThreshold, 0, 0));
+      for(int i=1; i<LEVELS; i++)
+	vJobs.push_back(DetectCornersJob(aLevels[i], gaLevelParams[i].nFASTThreshold, 0, aLevels[i].im.size().y));
+      RunJobs(*pPool, vJobs);
+      
+      for(unsigned int j=0; j<vJobs.size(); j++)
+	{
+	  vector<ImageRef> &vCorners = vJobs[j].pLevel->vCorners;
+	  vCorners.insert(vCorners.end(), vJobs[j].vCorners.begin(), vJobs[j].vCorners.end());
+	}
+      for(int i=0; i<LEVELS; i++)
 	{
-	  while(v < lev.vCorners.size() && y > lev.vCorners[v].y)
-	    v++;
-	  lev.vCornerRowLUT.push_back(v);
+	  ExtendRowLUT(aLevels[i], aLevels[i].im.size().y);
+	  MakeCornerGrid(aLevels[i]);
 	}
-    };
+      return;
+    }
+  
+  do
+    {
+      // Copy out the next band of image data to the pyramid's zero level.
+      {
+	Level &lev = aLevels[0];
+	int nEnd = min(lev.im.size().y, anRowsMade[0] + KF_LITE_BAND_ROWS);
+	for(int y=anRowsMade[0]; y<nEnd; y++)
+	  memcpy(lev.im[y], im[y], lev.im.size().x);
+	anRowsMade[0] = nEnd;
+      }
+      
+      // Then, for each level...
+      for(int i=0; i<LEVELS; i++)
+	{
+	  Level &lev = aLevels[i];
+	  int nHeight = lev.im.size().y;
+	  if(i!=0)
+	    {  // .. make as many rows of the half-size image as the previous level allows..
+	      int nEnd = min(nHeight, anRowsMade[i-1] / 2);
+	      if(nEnd < nHeight)
+		nEnd -= nEnd % 16;
+	      if(nEnd > anRowsMade[i])
+		{
+		  Level &levAbove = aLevels[i-1];
+		  int nStart = anRowsMade[i];
+		  BasicImage<byte> imIn(levAbove.im[2 * nStart], ImageRef(levAbove.im.size().x, 2 * (nEnd - nStart)));
+		  BasicImage<byte> imOut(lev.im[nStart], ImageRef(lev.im.size().x, nEnd - nStart));
+		  halfSample(imIn, imOut);
+		  anRowsMade[i] = nEnd;
+		}
+	    }
+	  
+	  // .. sum up the new rows while they're in the cache..
+	  if(bIntegrals && anRowsMade[i] > anRowsSummed[i])
+	    {
+	      MakeIntegralRows(lev, anRowsSummed[i], anRowsMade[i]);
+	      anRowsSummed[i] = anRowsMade[i];
+	    }
+	  
+	  // .. and detect and store FAST corner points in the rows which are complete
+	  // including their neighbourhood.
+	  int nEnd = (anRowsMade[i] == nHeight) ? nHeight : anRowsMade[i] - 3;
+	  if(nEnd > anRowsDetected[i])
+	    {
+	      DetectCornersInRows(lev.im, gaLevelParams[i].nFASTThreshold, anRowsDetected[i], nEnd, lev.vCorners);
+	      ExtendRowLUT(lev, nEnd);
+	      anRowsDetected[i] = nEnd;
+	    }
+	}
+    }
+  while(anRowsMade[0] < aLevels[0].im.size().y);
+  
+  for(int i=0; i<LEVELS; i++)
+    MakeCornerGrid(aLevels[i]);
 }
 
-void KeyFrame::MakeKeyFrame_Rest()
+void KeyFrame::MakeKeyFrame_Rest(WorkerPool *pPool)
 {
   // Fills the rest of the keyframe structure needed by the mapmaker:
   // FAST nonmax suppression, generation of the list of candidates for further map points,
   // creation of the relocaliser's SmallBlurryImage.
   static gvar3<double> gvdCandidateMinSTScore("MapMaker.CandidateMinShiTomasiScore", MAPMAKER_MIN_SHI_THOMASI_SCORE, SILENT);
+  double dMinSTScore = *gvdCandidateMinSTScore;
   
-  // For each level...
-  for(int l=0; l<LEVELS; l++)
-    {
-      Level &lev = aLevels[l];
-      // .. find those FAST corners which are maximal..
-      fast_nonmax(lev.im, lev.vCorners, 10, lev.vMaxCorners);
-      // .. and then calculate the Shi-Tomasi scores of those, and keep the ones with
-      // a suitably high score as Candidates, i.e. points which the mapmaker will attempt
-      // to make new map points out of.
-      for(vector<ImageRef>::iterator i=lev.vMaxCorners.begin(); i!=lev.vMaxCorners.end(); i++)
+  if(pPool)
+    { // Same as below, but all levels in parallel.
+      vector<FindCandidatesJob> vJobs;
+      AddBandJobs(vJobs, aLevels[0], pPool->NumThreads() + 1, FindCandidatesJob(aLevels[0], 0, 0, dMinSTScore));
+      for(int l=1; l<LEVELS; l++)
+	vJobs.push_back(FindCandidatesJob(aLevels[l], 0, aLevels[l].im.size().y, dMinSTScore));
+      RunJobs(*pPool, vJobs);
+      
+      for(int l=0; l<LEVELS; l++)
+	aLevels[l].vMaxCorners.clear();
+      for(unsigned int j=0; j<vJobs.size(); j++)
 	{
-	  if(!lev.im.in_image_with_border(*i, 10))
-	    continue;
-	  double dSTScore = FindShiTomasiScoreAtPoint(lev.im, 3, *i);
-	  if(dSTScore > *gvdCandidateMinSTScore)
-	    {
-	      Candidate c;
-	      c.irLevelPos = *i;
-	      c.dSTScore = dSTScore;
-	      lev.vCandidates.push_back(c);
-	    }
+	  Level &lev = *vJobs[j].pLevel;
+	  lev.vMaxCorners.insert(lev.vMaxCorners.end(), vJobs[j].vMaxCorners.begin(), vJobs[j].vMaxCorners.end());
+	  lev.vCandidates.insert(lev.vCandidates.end(), vJobs[j].vCandidates.begin(), vJobs[j].vCandidates.end());
 	}
-    };
+    }
+  else
+    // For each level, find those FAST corners which are maximal, and then calculate 
+    // the Shi-Tomasi scores of those, and keep the ones with a suitably high score as Candidates.
+    for(int l=0; l<LEVELS; l++)
+      FindCandidatesInRows(aLevels[l], 0, aLevels[l].im.size().y, dMinSTScore, aLevels[l].vMaxCorners, aLevels[l].vCandidates);
   
   // Also, make a SmallBlurryImage of the keyframe: The relocaliser uses these.
   pSBI = new SmallBlurryImage(*this);  
@@ -102,15 +421,223 @@ void KeyFrame::MakeKeyFrame_Rest()
 Level& Level::operator=(const Level &rhs)
 {
   // Operator= should physically copy pixels, not use CVD's reference-counting image copy.
-  im.resize(rhs.im.size());
+  ImagePool<byte>::Instance().Resize(im, rhs.im.size());
   copy(rhs.im, im);
   
   vCorners = rhs.vCorners;
   vMaxCorners = rhs.vMaxCorners;
   vCornerRowLUT = rhs.vCornerRowLUT;
+  nCornerGridWidth = rhs.nCornerGridWidth;
+  nCornerGridHeight = rhs.nCornerGridHeight;
+  vCornerGridStart = rhs.vCornerGridStart;
+  vCornerGridIndex = rhs.vCornerGridIndex;
+  bIntegralsMade = false;
   return *this;
 }
 
+// Hands a keyframe's data over to this one in constant time, for when the
+// tracker gives its current frame to the mapmaker. The level images change
+// owner through CVD's reference-counted assignment and k drops its reference
+// straight away, so the two never share pixels (nor a reference count across
+// threads); k's next MakeKeyFrame_Lite just allocates new level images.
+void KeyFrame::TakeOver(KeyFrame &k)
+{
+  se3CfromW = k.se3CfromW;
+  bFixed = k.bFixed;
+  dSceneDepthMean = k.dSceneDepthMean;
+  dSceneDepthSigma = k.dSceneDepthSigma;
+  mMeasurements.clear();
+  mMeasurements.swap(k.mMeasurements);
+  
+  for(int i=0; i<LEVELS; i++)
+    {
+      Level &lev = aLevels[i];
+      Level &levSrc = k.aLevels[i];
+      lev.im = levSrc.im;    // Image::operator=, not Level::operator=: no pixel copy
+      levSrc.im = Image<byte>();
+      lev.vCorners.clear();
+      lev.vCorners.swap(levSrc.vCorners);
+      lev.vCornerRowLUT.clear();
+      lev.vCornerRowLUT.swap(levSrc.vCornerRowLUT);
+      lev.vMaxCorners.clear();
+      lev.vMaxCorners.swap(levSrc.vMaxCorners);
+      lev.nCornerGridWidth = levSrc.nCornerGridWidth;
+      lev.nCornerGridHeight = levSrc.nCornerGridHeight;
+      lev.vCornerGridStart.clear();
+      lev.vCornerGridStart.swap(levSrc.vCornerGridStart);
+      lev.vCornerGridIndex.clear();
+      lev.vCornerGridIndex.swap(levSrc.vCornerGridIndex);
+      lev.vCandidates.clear();
+      lev.bImplaneCornersCached = false;
+      lev.vImplaneCorners.clear();
+      lev.bIntegralsMade = false;   // k keeps its integral images for the next frame
+    }
+}
+
+// Counters of the keyframe cold storage, for PrintColdStorageStats().
+static pthread_mutex_t mutexColdStorageStats = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nColdCompressions = 0;
+static unsigned long nColdDecompressions = 0;
+static double dColdCompressTime = 0.0;
+static double dColdDecompressTime = 0.0;
+static double dColdDecompressMaxTime = 0.0;
+static size_t nColdBytesRaw = 0;        // Of the images currently compressed..
+static size_t nColdBytesCompressed = 0; // .. and their compressed copies
+
+// Called before a keyframe is deleted, so that its level images
+// can be re-used by the frames to come.
+void KeyFrame::ReleaseImages()
+{
+  for(int i=0; i<LEVELS; i++)
+    ImagePool<byte>::Instance().Release(aLevels[i].im);
+  if(!bImagesCompressed)
+    return;
+  
+  pthread_mutex_lock(&mutexColdStorageStats);
+  for(int i=0; i<LEVELS; i++)
+    {
+      nColdBytesRaw -= acimLevels[i].Size().area();
+      nColdBytesCompressed -= acimLevels[i].Bytes();
+      acimLevels[i].Clear();
+    }
+  pthread_mutex_unlock(&mutexColdStorageStats);
+  bImagesCompressed = false;
+}
+
+// Compresses the level images, and gives the image buffers back to the pool.
+// The compression itself is done without holding the mutex: the images can only
+// go away in here, so the tracker is free to keep reading them meanwhile.
+void KeyFrame::CompressImages()
+{
+  if(bImagesCompressed)
+    return;
+  double dStart = timer.get_time();
+  CompressedImage acim[LEVELS];
+  size_t nRaw = 0;
+  size_t nCompressed = 0;
+  for(int i=0; i<LEVELS; i++)
+    {
+      acim[i].Compress(aLevels[i].im);
+      nRaw += aLevels[i].im.size().area();
+      nCompressed += acim[i].Bytes();
+    }
+  
+  Image<byte> aimOld[LEVELS];
+  pthread_mutex_lock(&mutexImages.mutex);
+  for(int i=0; i<LEVELS; i++)
+    {
+      acimLevels[i] = acim[i];
+      aimOld[i] = aLevels[i].im;
+      aLevels[i].im = Image<byte>();
+    }
+  bImagesCompressed = true;
+  pthread_mutex_unlock(&mutexImages.mutex);
+  
+  for(int i=0; i<LEVELS; i++)
+    ImagePool<byte>::Instance().Release(aimOld[i]);
+  
+  pthread_mutex_lock(&mutexColdStorageStats);
+  nColdCompressions++;
+  dColdCompressTime += timer.get_time() - dStart;
+  nColdBytesRaw += nRaw;
+  nColdBytesCompressed += nCompressed;
+  pthread_mutex_unlock(&mutexColdStorageStats);
+}
+
+// Decompresses outside the mutex, the same way round as CompressImages(): while
+// bImagesDecompressing is set, the compressed copies can't go away (only this
+// thread clears them, and they are only replaced by compressing, which isn't done
+// to compressed images), and other threads which want the images wait for them.
+void KeyFrame::LockImages()
+{
+  pthread_mutex_lock(&mutexImages.mutex);
+  dImagesLastUsed = timer.get_time();
+  while(bImagesDecompressing)
+    pthread_cond_wait(&mutexImages.cond, &mutexImages.mutex);
+  if(!bImagesCompressed)
+    return;
+  
+  bImagesDecompressing = true;
+  pthread_mutex_unlock(&mutexImages.mutex);
+  double dStart = timer.get_time();
+  Image<byte> aimNew[LEVELS];
+  size_t nRaw = 0;
+  size_t nCompressed = 0;
+  for(int i=0; i<LEVELS; i++)
+    {
+      acimLevels[i].Decompress(aimNew[i]);
+      nRaw += aimNew[i].size().area();
+      nCompressed += acimLevels[i].Bytes();
+    }
+  double dTime = timer.get_time() - dStart;
+  
+  pthread_mutex_lock(&mutexImages.mutex);
+  for(int i=0; i<LEVELS; i++)
+    {
+      aLevels[i].im = aimNew[i];
+      acimLevels[i].Clear();
+    }
+  bImagesCompressed = false;
+  bImagesWanted = false;
+  bImagesDecompressing = false;
+  pthread_cond_broadcast(&mutexImages.cond);
+  
+  pthread_mutex_lock(&mutexColdStorageStats);
+  nColdDecompressions++;
+  dColdDecompressTime += dTime;
+  if(dTime > dColdDecompressMaxTime)
+    dColdDecompressMaxTime = dTime;
+  nColdBytesRaw -= nRaw;
+  nColdBytesCompressed -= nCompressed;
+  pthread_mutex_unlock(&mutexColdStorageStats);
+}
+
+// A busy mutex counts the same as compressed images: somebody is probably
+// decompressing them, and if not, the tracker will get them next frame.
+bool KeyFrame::TryLockImages()
+{
+  if(pthread_mutex_trylock(&mutexImages.mutex) != 0)
+    return false;
+  dImagesLastUsed = timer.get_time();
+  if(!bImagesCompressed)
+    return true;
+  if(!bImagesDecompressing)
+    bImagesWanted = true;
+  pthread_mutex_unlock(&mutexImages.mutex);
+  return false;
+}
+
+void KeyFrame::TouchImages()
+{
+  if(pthread_mutex_trylock(&mutexImages.mutex) != 0)
+    return;
+  dImagesLastUsed = timer.get_time();
+  pthread_mutex_unlock(&mutexImages.mutex);
+}
+
+void KeyFrame::UnlockImages()
+{
+  pthread_mutex_unlock(&mutexImages.mutex);
+}
+
+void KeyFrame::UseImages()
+{
+  LockImages();
+  UnlockImages();
+}
+
+void PrintColdStorageStats(ostream &os)
+{
+  pthread_mutex_lock(&mutexColdStorageStats);
+  os << "  KeyFrame cold storage: " << nColdCompressions << " compressions ("
+     << (nColdCompressions ? 1000.0 * dColdCompressTime / nColdCompressions : 0.0) << " ms avg), "
+     << nColdDecompressions << " decompressions ("
+     << (nColdDecompressions ? 1000.0 * dColdDecompressTime / nColdDecompressions : 0.0) << " ms avg, "
+     << 1000.0 * dColdDecompressMaxTime << " ms max); "
+     << nColdBytesRaw << " bytes of images held in " << nColdBytesCompressed << " bytes" << endl;
+  pthread_mutex_unlock(&mutexColdStorageStats);
+}
+
 // -------------------------------------------------------------
 // Some useful globals defined in LevelHelpers.h live here:
 Vector<3> gavLevelColors[LEVELS];
@@ -122,11 +649,8 @@ struct LevelHelpersFiller // Code which should be initialised on init goes here;
   {
     for(int i=0; i<LEVELS; i++)
       {
-	if(i==0)  gavLevelColors[i] = makeVector( 1.0, 0.0, 0.0);
-	else if(i==1)  gavLevelColors[i] = makeVector( 1.0, 1.0, 0.0);
-	else if(i==2)  gavLevelColors[i] = makeVector( 0.0, 1.0, 0.0);
-	else if(i==3)  gavLevelColors[i] = makeVector( 0.0, 0.0, 0.7);
-	else gavLevelColors[i] =  makeVector( 1.0, 1.0, 0.7); // In case I ever run with LEVELS > 4
+	const double *adColor = gaLevelParams[i].adColor;
+	gavLevelColors[i] = makeVector(adColor[0], adColor[1], adColor[2]);
       }
   }
 };
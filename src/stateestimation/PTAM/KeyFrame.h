@@ -22,14 +22,20 @@ using namespace TooN;
 #include <TooN/se3.h>
 #include <cvd/image.h>
 #include <cvd/byte.h>
+#include <cvd/timer.h>
+#include <pthread.h>
 #include <vector>
 #include <set>
 #include <map>
+#include <ostream>
+#include "CompressedImage.h"
 
 class MapPoint;
 class SmallBlurryImage;
+class WorkerPool;
 
 #define LEVELS 4
+#define CORNER_GRID_CELL_SIZE 16  // Side of the cells of each level's FAST corner bucket grid, in level pixels
 
 // Candidate: a feature in an image which could be made into a map point
 struct Candidate
@@ -55,11 +61,21 @@ struct Level
   inline Level()
   {
     bImplaneCornersCached = false;
+    bIntegralsMade = false;
+    nCornerGridWidth = nCornerGridHeight = 0;
   };
   
   CVD::Image<CVD::byte> im;                // The pyramid level pixels
   std::vector<CVD::ImageRef> vCorners;     // All FAST corners on this level
   std::vector<int> vCornerRowLUT;          // Row-index into the FAST corners, speeds up access
+  
+  // Bucket grid of the FAST corners, for finding those near a point: the corners in cell
+  // (cx, cy) are vCorners[vCornerGridIndex[k]] for k in [vCornerGridStart[c], vCornerGridStart[c+1]),
+  // where c = cy * nCornerGridWidth + cx; they are in the same order as in vCorners.
+  int nCornerGridWidth;
+  int nCornerGridHeight;
+  std::vector<int> vCornerGridStart;
+  std::vector<int> vCornerGridIndex;
   std::vector<CVD::ImageRef> vMaxCorners;  // The maximal FAST corners
   Level& operator=(const Level &rhs);
   
@@ -67,6 +83,27 @@ struct Level
   
   bool bImplaneCornersCached;           // Also keep image-plane (z=1) positions of FAST corners to speed up epipolar search
   std::vector<Vector<2> > vImplaneCorners; // Corner points un-projected into z=1-plane coordinates
+  
+  // Optionally (KeyFrame.IntegralImages), the tracker's frames also get integral images of
+  // the pixels and squared pixels, (W+1)x(H+1) with a zero first row and column, so that
+  // PatchFinder's coarse search only has to compute the cross term of each ZMSSD.
+  // These are unsigned and wrap around on big levels; box sums (differences) are still exact.
+  bool bIntegralsMade;
+  CVD::Image<unsigned int> imSum;
+  CVD::Image<unsigned int> imSumSq;
+};
+
+// A mutex (and a condition to go with it) which doesn't mind being part of a
+// copyable struct: a copy gets a mutex of its own, and assignment leaves it alone.
+struct KeyFrameMutex
+{
+  inline KeyFrameMutex() { Init(); }
+  inline KeyFrameMutex(const KeyFrameMutex &) { Init(); }
+  inline KeyFrameMutex& operator=(const KeyFrameMutex &) { return *this; }
+  inline ~KeyFrameMutex() { pthread_cond_destroy(&cond); pthread_mutex_destroy(&mutex); }
+  inline void Init() { pthread_mutex_init(&mutex, NULL); pthread_cond_init(&cond, NULL); }
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
 };
 
 // The actual KeyFrame struct. The map contains of a bunch of these. However, the tracker uses this
@@ -77,6 +114,10 @@ struct KeyFrame
   inline KeyFrame()
   {
     pSBI = NULL;
+    bImagesCompressed = false;
+    bImagesWanted = false;
+    bImagesDecompressing = false;
+    dImagesLastUsed = CVD::timer.get_time();
   }
   SE3<> se3CfromW;    // The coordinate frame of this key-frame as a Camera-From-World transformation
   bool bFixed;      // Is the coordinate frame of this keyframe fixed? (only true for first KF!)
@@ -85,7 +126,31 @@ struct KeyFrame
   
   void MakeKeyFrame_Lite(CVD::BasicImage<CVD::byte> &im);   // This takes an image and calculates pyramid levels etc to fill the 
                                                             // keyframe data structures with everything that's needed by the tracker..
-  void MakeKeyFrame_Rest();                                 // ... while this calculates the rest of the data which the mapmaker needs.
+  void MakeKeyFrame_Rest(WorkerPool *pPool);                // ... while this calculates the rest of the data which the mapmaker needs,
+                                                            // on the calling thread's worker pool (NULL: none.)
+  void TakeOver(KeyFrame &k);                               // Moves k's pyramid and measurements into this keyframe without copying pixels.
+  void ReleaseImages();                                     // Gives the pyramid's image buffers back to the ImagePool.
+  
+  // Cold storage: the level images of a keyframe which hasn't been used for a while can be
+  // swapped for compressed copies. Only the mapmaker thread compresses; after UseImages()
+  // the images are therefore there for the mapmaker until it calls CompressImages() itself.
+  // Other threads must hold LockImages() while they read the level images. The mutex is
+  // only ever held for short spells: decompression is done outside it, and others who
+  // want the images wait for it on mutexImages.cond. The tracker can't afford to wait
+  // at all, so it uses TryLockImages() instead, and asks the mapmaker to decompress what
+  // it found cold or busy (MapMaker::RequestDecompression.)
+  void CompressImages();       // Mapmaker thread only
+  void UseImages();            // Makes sure the level images are there, decompressing them if needed
+  void LockImages();           // .. the same, and keeps them there until UnlockImages()
+  bool TryLockImages();        // .. only if they're there already and the mutex is free; otherwise returns false
+  void UnlockImages();
+  void TouchImages();          // Counts as a use, for the cold storage age; never waits
+  bool bImagesCompressed;      // Are the level images only in acimLevels right now?
+  bool bImagesWanted;          // Did TryLockImages() find them compressed? Guarded by mutexImages
+  bool bImagesDecompressing;   // Is somebody decompressing them right now? Guarded by mutexImages
+  double dImagesLastUsed;      // When they were last asked for (CVD::timer seconds)
+  CompressedImage acimLevels[LEVELS];
+  KeyFrameMutex mutexImages;   // Guards the switches between the two states
   
   double dSceneDepthMean;      // Hacky hueristics to improve epipolar search.
   double dSceneDepthSigma;
@@ -93,6 +158,10 @@ struct KeyFrame
   SmallBlurryImage *pSBI; // The relocaliser uses this
 };
 
+void PrintColdStorageStats(std::ostream &os);   // How much, and how often, keyframes were (de-)compressed
+WorkerPool *KeyFrameWorkerPool();               // The tracker thread's worker threads; NULL if there are none
+WorkerPool *MapMakerWorkerPool();               // The mapmaker thread's worker threads; NULL if there are none
+
 typedef std::map<MapPoint*, Measurement>::iterator meas_it;  // For convenience, and to work around an emacs paren-matching bug
 
 
@@ -1,19 +1,67 @@
 // Copyright 2008 Isis Innovation Limited
 #include "Map.h"
 #include "MapPoint.h"
+#include "KeyFrame.h"
+#include "SmallBlurryImage.h"
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#define KEYFRAME_TREE_LEAF 8   // Most centres in a leaf
+
+// The readers and the writer only share the snapshot pointer, the epoch counter and the
+// readers' epochs, and these are only accessed with the gcc compare-and-swap builtin,
+// which is also a full memory barrier. The protocol is:
+// Reader: store the current epoch in its slot; then load the snapshot pointer.
+// Writer: store the new snapshot pointer; then increment the epoch. Anything it removes
+// from the published map is tagged with the new epoch E, and can be deleted once every
+// reader's slot is either zero or at least E: a reader which entered at an older epoch may
+// have loaded the old pointer, but one which stored E (or a later epoch) cannot have.
+// Each of these has only one thread storing to it, so the stores' loops run once.
+template<class T> static inline T AtomicLoad(T *p)
+{
+  return __sync_val_compare_and_swap(p, (T) 0, (T) 0);
+}
+template<class T> static inline void AtomicStore(T *p, T t)
+{
+  T old = AtomicLoad(p);
+  for(T prev; (prev = __sync_val_compare_and_swap(p, old, t)) != old; )
+    old = prev;
+}
 
 Map::Map()
 {
+  mnEpoch = 1;
+  mnReaders = 0;
+  for(int i=0; i<MAP_MAX_READERS; i++)
+    manReaderEpochs[i] = 0;
+  mpSnapshot = new MapSnapshot;
   Reset();
 }
 
+Map::~Map()
+{
+  Reset();
+  EmptyTrash();
+  ReclaimGarbage(AtomicLoad(&mnEpoch));
+  delete mpSnapshot;
+}
+
+// Wipes the map. The points and keyframes go to the garbage, and are deleted as soon
+// as no reader can see them any more; if nobody is reading, that's straight away.
 void Map::Reset()
 {
   for(unsigned int i=0; i<vpPoints.size(); i++)
-    delete vpPoints[i];
+    vpPointsTrash.push_back(vpPoints[i]);
   vpPoints.clear();
+  std::vector<KeyFrame*> vpOldKeyFrames;
+  vpOldKeyFrames.swap(vpKeyFrames);
   bGood = false;
-  EmptyTrash();
+  Publish();
+  for(unsigned int i=0; i<vpOldKeyFrames.size(); i++)
+    mvRetiredKeyFrames.push_back(std::make_pair(vpOldKeyFrames[i], AtomicLoad(&mnEpoch)));
+  mvnTrashEpochs.resize(vpPointsTrash.size(), AtomicLoad(&mnEpoch));
+  ReclaimGarbage(MinReaderEpoch());
 }
 
 void Map::MoveBadPointsToTrash()
@@ -28,15 +76,396 @@ void Map::MoveBadPointsToTrash()
 	  nBad++;
 	}
     };
+  if(nBad == 0)
+    return;
+  Publish();   // The new trash is tagged with the epoch from which it isn't published any more
+  mvnTrashEpochs.resize(vpPointsTrash.size(), AtomicLoad(&mnEpoch));
 };
 
+// Deletes all trashed points, whether readers might see them or not!
+// Only for when there are no readers.
 void Map::EmptyTrash()
 {
   for(unsigned int i=0; i<vpPointsTrash.size(); i++)
     delete vpPointsTrash[i];
   vpPointsTrash.clear();
+  mvnTrashEpochs.clear();
 };
 
+void Map::DeleteKeyFrame(KeyFrame *pK)
+{
+  pK->ReleaseImages();
+  delete pK->pSBI;
+  delete pK;
+}
+
+// Copies the lists and the geometry into a new snapshot, and swaps it in.
+void Map::Publish()
+{
+  MapSnapshot *pNew = new MapSnapshot;
+  pNew->vPoints.resize(vpPoints.size());
+  for(unsigned int i=0; i<vpPoints.size(); i++)
+    {
+      MapSnapshot::Point &sp = pNew->vPoints[i];
+      MapPoint &p = *vpPoints[i];
+      sp.pPoint = &p;
+      sp.v3WorldPos = p.v3WorldPos;
+      sp.v3PixelRight_W = p.v3PixelRight_W;
+      sp.v3PixelDown_W = p.v3PixelDown_W;
+    }
+  RefreshKeyFrameCentres();
+  pNew->KeyFrameCentres = KeyFrameCentres;
+  pNew->vKeyFrames.resize(vpKeyFrames.size());
+  for(unsigned int i=0; i<vpKeyFrames.size(); i++)
+    {
+      MapSnapshot::KeyFrameEntry &sk = pNew->vKeyFrames[i];
+      sk.pKF = vpKeyFrames[i];
+      sk.se3CfromW = vpKeyFrames[i]->se3CfromW;
+      sk.v3CamPos = KeyFrameCentres.GetCentre(i);
+    }
+  
+  MapSnapshot *pOld = AtomicLoad(&mpSnapshot);
+  AtomicStore(&mpSnapshot, pNew);
+  unsigned int nEpoch = AtomicLoad(&mnEpoch) + 1;
+  AtomicStore(&mnEpoch, nEpoch);
+  pOld->nRetiredEpoch = nEpoch;
+  mvpRetiredSnapshots.push_back(pOld);
+}
+
+void Map::RefreshKeyFrameCentres()
+{
+  KeyFrameCentres.Refresh(vpKeyFrames);
+}
+
+unsigned int Map::MinReaderEpoch()
+{
+  unsigned int nMin = AtomicLoad(&mnEpoch);
+  for(int i=0; i<MAP_MAX_READERS; i++)
+    {
+      unsigned int n = AtomicLoad(&manReaderEpochs[i]);
+      if(n != 0 && n < nMin)
+	nMin = n;
+    }
+  return nMin;
+}
+
+// Deletes the retired snapshots, trashed points and keyframes which were
+// removed from the published map no later than nSafeEpoch. With the result
+// of MinReaderEpoch() that's everything no current reader can see.
+// (Callers who hand map pointers around outside of snapshots, like the
+// mapmaker's keyframe queue, can get MinReaderEpoch() first, and then
+// check that there are no such pointers in flight.)
+void Map::ReclaimGarbage(unsigned int nSafeEpoch)
+{
+  unsigned int nMin = nSafeEpoch;
+  
+  unsigned int nKept = 0;
+  for(unsigned int i=0; i<mvpRetiredSnapshots.size(); i++)
+    if(mvpRetiredSnapshots[i]->nRetiredEpoch <= nMin)
+      delete mvpRetiredSnapshots[i];
+    else
+      mvpRetiredSnapshots[nKept++] = mvpRetiredSnapshots[i];
+  mvpRetiredSnapshots.resize(nKept);
+  
+  nKept = 0;
+  for(unsigned int i=0; i<vpPointsTrash.size(); i++)
+    if(mvnTrashEpochs[i] <= nMin)
+      delete vpPointsTrash[i];
+    else
+      {
+	vpPointsTrash[nKept] = vpPointsTrash[i];
+	mvnTrashEpochs[nKept] = mvnTrashEpochs[i];
+	nKept++;
+      }
+  vpPointsTrash.resize(nKept);
+  mvnTrashEpochs.resize(nKept);
+  
+  nKept = 0;
+  for(unsigned int i=0; i<mvRetiredKeyFrames.size(); i++)
+    if(mvRetiredKeyFrames[i].second <= nMin)
+      DeleteKeyFrame(mvRetiredKeyFrames[i].first);
+    else
+      mvRetiredKeyFrames[nKept++] = mvRetiredKeyFrames[i];
+  mvRetiredKeyFrames.resize(nKept);
+}
+
+int Map::RegisterReader()
+{
+  int nReader = __sync_fetch_and_add(&mnReaders, 1);
+  assert(nReader < MAP_MAX_READERS);
+  return nReader;
+}
+
+const MapSnapshot &Map::BeginRead(int nReader)
+{
+  AtomicStore(&manReaderEpochs[nReader], AtomicLoad(&mnEpoch));
+  return *AtomicLoad(&mpSnapshot);
+}
+
+void Map::EndRead(int nReader)
+{
+  AtomicStore(&manReaderEpochs[nReader], 0u);
+}
+
+double MapSnapshot::DistToNearestKeyFrame(const TooN::Vector<3> &v3CamPos) const
+{
+  double dClosestDistSq = 9999999999.9;
+  std::vector<std::pair<double, int> > vClosest;
+  KeyFrameCentres.NClosest(v3CamPos, 1, NULL, vClosest);
+  if(vClosest.size() > 0 && vClosest[0].first < dClosestDistSq)
+    dClosestDistSq = vClosest[0].first;
+  return sqrt(dClosestDistSq);
+}
+
+// Squared distance from a point to a box; zero inside it.
+static inline double BoxDistSq(const TooN::Vector<3> &v3Min, const TooN::Vector<3> &v3Max, const TooN::Vector<3> &v3Pos)
+{
+  double dDistSq = 0.0;
+  for(int j=0; j<3; j++)
+    {
+      double d = 0.0;
+      if(v3Pos[j] < v3Min[j])
+	d = v3Min[j] - v3Pos[j];
+      else if(v3Pos[j] > v3Max[j])
+	d = v3Pos[j] - v3Max[j];
+      dDistSq += d * d;
+    }
+  return dDistSq;
+}
+
+KeyFrameTree::KeyFrameTree()
+{
+  mnMaxDepth = 0;
+}
+
+void KeyFrameTree::Refresh(const std::vector<KeyFrame*> &vpKeyFrames)
+{
+  bool bRebuild = vpKeyFrames.size() < mvEntries.size();
+  bool bMoved = false;
+  unsigned int nOld = mvEntries.size();
+  mvEntries.resize(vpKeyFrames.size());
+  for(unsigned int i=0; i<mvEntries.size(); i++)
+    {
+      Entry &e = mvEntries[i];
+      TooN::Vector<3> v3Centre = vpKeyFrames[i]->se3CfromW.inverse().get_translation();
+      if(i >= nOld)
+	e.pKF = vpKeyFrames[i];
+      else if(e.pKF != vpKeyFrames[i])  // The list was replaced, not added to
+	{
+	  e.pKF = vpKeyFrames[i];
+	  bRebuild = true;
+	}
+      else if(v3Centre[0] != e.v3Centre[0] || v3Centre[1] != e.v3Centre[1] || v3Centre[2] != e.v3Centre[2])
+	bMoved = true;
+      e.v3Centre = v3Centre;
+    }
+  
+  if(bRebuild)
+    {
+      Build();
+      return;
+    }
+  if(bMoved)
+    Refit();
+  for(unsigned int i=nOld; i<mvEntries.size(); i++)
+    Insert(i);
+  
+  // Keyframes tend to be added along the camera's path, which can make a chain of
+  // splits on one side of the tree. Rebuild once it's twice as deep as a balanced one.
+  int nBalancedDepth = 0;
+  for(unsigned int n = mvEntries.size() / KEYFRAME_TREE_LEAF; n > 0; n /= 2)
+    nBalancedDepth++;
+  if(mnMaxDepth > 2 * nBalancedDepth + 2)
+    Build();
+}
+
+// Orders entries along one axis of their centres, for the median split.
+struct KeyFrameTree::AxisLess
+{
+  AxisLess(const std::vector<Entry> &v, int n) : vEntries(v), nAxis(n) {}
+  bool operator()(int a, int b) const {return vEntries[a].v3Centre[nAxis] < vEntries[b].v3Centre[nAxis];}
+  const std::vector<Entry> &vEntries;
+  int nAxis;
+};
+
+void KeyFrameTree::Build()
+{
+  mvNodes.clear();
+  mnMaxDepth = 0;
+  if(mvEntries.size() == 0)
+    return;
+  std::vector<int> vnOrder(mvEntries.size());
+  for(unsigned int i=0; i<vnOrder.size(); i++)
+    vnOrder[i] = i;
+  mvNodes.push_back(Node());
+  MakeNode(0, vnOrder, 0, vnOrder.size(), 0);
+}
+
+// Fills in node nNode with entries vnOrder[nFirst..nLast): a leaf if they fit
+// in one, otherwise split at the median along the box's longest side.
+void KeyFrameTree::MakeNode(int nNode, std::vector<int> &vnOrder, int nFirst, int nLast, int nDepth)
+{
+  if(nDepth > mnMaxDepth)
+    mnMaxDepth = nDepth;
+  Node &n = mvNodes[nNode];
+  n.nLeft = n.nRight = -1;
+  n.vnEntries.clear();
+  n.v3Min = n.v3Max = mvEntries[vnOrder[nFirst]].v3Centre;
+  for(int i=nFirst+1; i<nLast; i++)
+    for(int j=0; j<3; j++)
+      {
+	double d = mvEntries[vnOrder[i]].v3Centre[j];
+	if(d < n.v3Min[j]) n.v3Min[j] = d;
+	if(d > n.v3Max[j]) n.v3Max[j] = d;
+      }
+  if(nLast - nFirst <= KEYFRAME_TREE_LEAF)
+    {
+      n.vnEntries.assign(vnOrder.begin() + nFirst, vnOrder.begin() + nLast);
+      return;
+    }
+  
+  TooN::Vector<3> v3Size = n.v3Max - n.v3Min;
+  int nAxis = 0;
+  for(int j=1; j<3; j++)
+    if(v3Size[j] > v3Size[nAxis])
+      nAxis = j;
+  int nMid = (nFirst + nLast) / 2;
+  std::nth_element(vnOrder.begin() + nFirst, vnOrder.begin() + nMid, vnOrder.begin() + nLast,
+		   AxisLess(mvEntries, nAxis));
+  
+  int nLeft = mvNodes.size();   // n isn't valid any more after these
+  mvNodes.push_back(Node());
+  mvNodes.push_back(Node());
+  mvNodes[nNode].nLeft = nLeft;
+  mvNodes[nNode].nRight = nLeft + 1;
+  MakeNode(nLeft, vnOrder, nFirst, nMid, nDepth + 1);
+  MakeNode(nLeft + 1, vnOrder, nMid, nLast, nDepth + 1);
+}
+
+// Adds entry nEntry: down to the leaf whose box is closest to its centre, growing
+// the boxes on the way, and splits that leaf if it's too full now.
+void KeyFrameTree::Insert(int nEntry)
+{
+  const TooN::Vector<3> &v3Centre = mvEntries[nEntry].v3Centre;
+  if(mvNodes.size() == 0)
+    {
+      std::vector<int> vnOrder(1, nEntry);
+      mvNodes.push_back(Node());
+      MakeNode(0, vnOrder, 0, 1, 0);
+      return;
+    }
+  
+  int nNode = 0;
+  int nDepth = 0;
+  for(;;)
+    {
+      Node &n = mvNodes[nNode];
+      for(int j=0; j<3; j++)
+	{
+	  if(v3Centre[j] < n.v3Min[j]) n.v3Min[j] = v3Centre[j];
+	  if(v3Centre[j] > n.v3Max[j]) n.v3Max[j] = v3Centre[j];
+	}
+      if(n.nLeft == -1)
+	break;
+      const Node &l = mvNodes[n.nLeft];
+      const Node &r = mvNodes[n.nRight];
+      if(BoxDistSq(l.v3Min, l.v3Max, v3Centre) <= BoxDistSq(r.v3Min, r.v3Max, v3Centre))
+	nNode = n.nLeft;
+      else
+	nNode = n.nRight;
+      nDepth++;
+    }
+  
+  mvNodes[nNode].vnEntries.push_back(nEntry);
+  if(mvNodes[nNode].vnEntries.size() > KEYFRAME_TREE_LEAF)
+    {
+      std::vector<int> vnOrder = mvNodes[nNode].vnEntries;
+      MakeNode(nNode, vnOrder, 0, vnOrder.size(), nDepth);
+    }
+}
+
+// Recomputes the boxes, children first. The tree's splits stay as they were;
+// they may get less good as the centres move, but the searches stay exact.
+void KeyFrameTree::Refit()
+{
+  for(int i=mvNodes.size()-1; i>=0; i--)
+    {
+      Node &n = mvNodes[i];
+      if(n.nLeft == -1)
+	{
+	  n.v3Min = n.v3Max = mvEntries[n.vnEntries[0]].v3Centre;
+	  for(unsigned int k=1; k<n.vnEntries.size(); k++)
+	    for(int j=0; j<3; j++)
+	      {
+		double d = mvEntries[n.vnEntries[k]].v3Centre[j];
+		if(d < n.v3Min[j]) n.v3Min[j] = d;
+		if(d > n.v3Max[j]) n.v3Max[j] = d;
+	      }
+	}
+      else
+	{
+	  const Node &l = mvNodes[n.nLeft];
+	  const Node &r = mvNodes[n.nRight];
+	  for(int j=0; j<3; j++)
+	    {
+	      n.v3Min[j] = std::min(l.v3Min[j], r.v3Min[j]);
+	      n.v3Max[j] = std::max(l.v3Max[j], r.v3Max[j]);
+	    }
+	}
+    }
+}
+
+void KeyFrameTree::NClosest(const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+			    std::vector<std::pair<double, int> > &vResult) const
+{
+  vResult.clear();
+  if(N > 0 && mvNodes.size() > 0)
+    Search(0, v3Pos, N, pExclude, vResult);
+}
+
+void KeyFrameTree::Search(int nNode, const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+			  std::vector<std::pair<double, int> > &vResult) const
+{
+  const Node &n = mvNodes[nNode];
+  if(n.nLeft == -1)
+    {
+      for(unsigned int i=0; i<n.vnEntries.size(); i++)
+	Consider(n.vnEntries[i], v3Pos, N, pExclude, vResult);
+      return;
+    }
+  // Nearer child first; the other one only if it may still hold something closer.
+  // (Boxes at exactly the current worst distance are still searched, so that
+  // ties go to the lowest entry, same as with a linear search.)
+  double dLeft = BoxDistSq(mvNodes[n.nLeft].v3Min, mvNodes[n.nLeft].v3Max, v3Pos);
+  double dRight = BoxDistSq(mvNodes[n.nRight].v3Min, mvNodes[n.nRight].v3Max, v3Pos);
+  int anChild[2] = {n.nLeft, n.nRight};
+  double adDist[2] = {dLeft, dRight};
+  if(dRight < dLeft)
+    {
+      std::swap(anChild[0], anChild[1]);
+      std::swap(adDist[0], adDist[1]);
+    }
+  for(int c=0; c<2; c++)
+    if(vResult.size() < N || adDist[c] <= vResult.back().first)
+      Search(anChild[c], v3Pos, N, pExclude, vResult);
+}
+
+void KeyFrameTree::Consider(int nEntry, const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+			    std::vector<std::pair<double, int> > &vResult) const
+{
+  const Entry &e = mvEntries[nEntry];
+  if(e.pKF == pExclude)
+    return;
+  TooN::Vector<3> v3Diff = e.v3Centre - v3Pos;
+  std::pair<double, int> dn(v3Diff * v3Diff, nEntry);
+  if(vResult.size() == N)
+    {
+      if(!(dn < vResult.back()))
+	return;
+      vResult.pop_back();
+    }
+  vResult.insert(std::upper_bound(vResult.begin(), vResult.end(), dn), dn);
+}
 
 
 
@@ -5,36 +5,147 @@
 // This is pretty light-weight: All it contains is
 // a vector of MapPoints and a vector of KeyFrames.
 //
-// N.b. since I don't do proper thread safety,
-// everything is stored as lists of pointers,
-// and map points are not erased if they are bad:
-// they are moved to the trash list. That way
-// old pointers which other threads are using are not 
-// invalidated!
+// The vectors themselves, and the points' and keyframes' geometry, are
+// only ever touched by one writer thread at a time: the mapmaker (or the
+// tracker, during stereo init, when there is no map yet.) Other threads
+// read the map through a MapSnapshot: an immutable copy of the lists
+// and of the geometry, which the writer publishes with Publish() after
+// each batch of changes. Readers never block the writer, and vice versa.
+//
+// Map points are not deleted when they turn bad: they are moved to the
+// trash list, and only deleted once no reader can still be looking at a
+// snapshot which contains them (epoch-based reclamation, see Map.cc.) The
+// same goes for old snapshots, and for keyframes removed by a reset.
+//
+// The keyframes' camera centres are also kept in a KeyFrameTree, so
+// that neighbour queries don't have to look at every keyframe.
 
 #ifndef __MAP_H
 #define __MAP_H
 #include <vector>
+#include <utility>
 #include <TooN/se3.h>
 #include <cvd/image.h>
 
 struct MapPoint;
 struct KeyFrame;
 
+#define MAP_MAX_READERS 4   // How many threads may hold snapshots
+
+// A kd-tree of keyframe camera centres. Entry i is the i'th keyframe of the list
+// given to Refresh(), which re-reads the centres from the keyframes' poses: moved
+// centres only refit the bounding boxes, and new keyframes are inserted into the
+// leaf nearest to them, which splits when it gets too full. The tree is only
+// rebuilt when the list was replaced, or when it got lopsided.
+class KeyFrameTree
+{
+public:
+  KeyFrameTree();
+  void Refresh(const std::vector<KeyFrame*> &vpKeyFrames);
+  inline unsigned int size() const {return mvEntries.size();}
+  inline KeyFrame* GetKeyFrame(int i) const {return mvEntries[i].pKF;}
+  inline const TooN::Vector<3> &GetCentre(int i) const {return mvEntries[i].v3Centre;}
+  
+  // Finds the N keyframes with centres closest to v3Pos, not counting pExclude.
+  // Gives (squared distance, entry) pairs, closest first.
+  void NClosest(const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+		std::vector<std::pair<double, int> > &vResult) const;
+  
+protected:
+  struct Entry
+  {
+    KeyFrame *pKF;
+    TooN::Vector<3> v3Centre;
+  };
+  struct Node
+  {
+    TooN::Vector<3> v3Min;   // Bounding box of the centres below
+    TooN::Vector<3> v3Max;
+    int nLeft;               // Children, or -1 for a leaf
+    int nRight;
+    std::vector<int> vnEntries;   // A leaf's entries
+  };
+  struct AxisLess;
+  void Build();
+  void MakeNode(int nNode, std::vector<int> &vnOrder, int nFirst, int nLast, int nDepth);
+  void Insert(int nEntry);
+  void Refit();
+  void Search(int nNode, const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+	      std::vector<std::pair<double, int> > &vResult) const;
+  void Consider(int nEntry, const TooN::Vector<3> &v3Pos, unsigned int N, KeyFrame *pExclude,
+		std::vector<std::pair<double, int> > &vResult) const;
+  
+  std::vector<Entry> mvEntries;
+  std::vector<Node> mvNodes;     // Root first; children always come after their parent
+  int mnMaxDepth;                // Depth of the deepest leaf
+};
+
+// What a reader sees of the map.
+struct MapSnapshot
+{
+  struct Point
+  {
+    MapPoint *pPoint;
+    TooN::Vector<3> v3WorldPos;
+    TooN::Vector<3> v3PixelRight_W;
+    TooN::Vector<3> v3PixelDown_W;
+  };
+  struct KeyFrameEntry
+  {
+    KeyFrame *pKF;
+    TooN::SE3<> se3CfromW;
+    TooN::Vector<3> v3CamPos;   // Camera centre, in world coords
+  };
+  std::vector<Point> vPoints;
+  std::vector<KeyFrameEntry> vKeyFrames;
+
+  KeyFrameTree KeyFrameCentres;   // Same centres as vKeyFrames, in the same order
+  
+  double DistToNearestKeyFrame(const TooN::Vector<3> &v3CamPos) const;  // Linear distance to the closest camera centre
+
+  unsigned int nRetiredEpoch;   // Used by the Map after the snapshot was replaced
+};
+
 struct Map
 {
   Map();
+  ~Map();
   inline bool IsGood() {return bGood;}
   void Reset();
   
   void MoveBadPointsToTrash();
   void EmptyTrash();
+  static void DeleteKeyFrame(KeyFrame *pK);  // Deletes a keyframe the map owns, giving its images back to the pool
   
+  // Writer's interface:
+  void Publish();          // Makes the current lists and geometry the snapshot readers get
+  void RefreshKeyFrameCentres();  // Call after adding or moving keyframes; Publish() does too
+  unsigned int MinReaderEpoch();                 // Oldest epoch a reader may still see
+  void ReclaimGarbage(unsigned int nSafeEpoch);  // Deletes what was retired by then; pass MinReaderEpoch()
+
+  // Readers' interface: each reading thread registers once, and then brackets its
+  // reads with BeginRead()/EndRead(). The snapshot stays valid until EndRead().
+  int RegisterReader();
+  const MapSnapshot &BeginRead(int nReader);
+  void EndRead(int nReader);
+
   std::vector<MapPoint*> vpPoints;
   std::vector<MapPoint*> vpPointsTrash;
   std::vector<KeyFrame*> vpKeyFrames;
+  KeyFrameTree KeyFrameCentres;   // The writer's neighbour index of vpKeyFrames
 
   bool bGood;
+
+protected:
+  MapSnapshot *mpSnapshot;                       // The current snapshot
+  unsigned int mnEpoch;                          // Incremented by each Publish()
+  unsigned int manReaderEpochs[MAP_MAX_READERS]; // Epoch at each reader's BeginRead(); zero if it isn't reading
+  int mnReaders;
+
+  // Garbage, with the epoch at which it was removed from the published map:
+  std::vector<MapSnapshot*> mvpRetiredSnapshots;
+  std::vector<unsigned int> mvnTrashEpochs;      // Parallel to vpPointsTrash
+  std::vector<std::pair<KeyFrame*, unsigned int> > mvRetiredKeyFrames;
 };
 
 
@@ -5,6 +5,8 @@
 #include "PatchFinder.h"
 #include "SmallMatrixOpts.h"
 #include "HomographyInit.h"
+#include "ImagePool.h"
+#include "WorkerPool.h"
 
 #include <cvd/vector_image_ref.h>
 #include <cvd/vision.h>
@@ -16,6 +18,8 @@
 #include <gvars3/instances.h>
 #include <fstream>
 #include <algorithm>
+#include <cerrno>
+#include <sys/time.h>
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -33,27 +37,41 @@ using namespace GVars3;
 MapMaker::MapMaker(Map& m, const ATANCamera &cam)
   : mMap(m), mCamera(cam)
 {
+  pthread_mutex_init(&mMutexWork, NULL);
+  pthread_cond_init(&mcondWork, NULL);
+  pthread_cond_init(&mcondResetDone, NULL);
+  mbWorkSignalled = false;
+  mbDecompressionRequested = false;
   mbResetRequested = false;
   Reset();
   start(); // This CVD::thread func starts the map-maker thread with function run()
   GUI.RegisterCommand("SaveMap", GUICommandCallBack, this);
+  GUI.RegisterCommand("ImagePoolStats", GUICommandCallBack, this);
+  GUI.RegisterCommand("ColdStorageStats", GUICommandCallBack, this);
   GV3::Register(mgvdWiggleScale, "MapMaker.WiggleScale", 0.1, SILENT); // Default to 10cm between keyframes
 };
 
 void MapMaker::Reset()
 {
   // This is only called from within the mapmaker thread...
-  mMap.Reset();
+  // (the tracker waits for the reset to be done, so it holds no map snapshot or keyframe pointers.)
+  mMap.Reset();  // This deletes the points and keyframes, too
   mvFailureQueue.clear();
   while(!mqNewQueue.empty()) mqNewQueue.pop();
-  mMap.vpKeyFrames.clear(); // TODO: actually erase old keyframes
-  mvpKeyFrameQueue.clear(); // TODO: actually erase old keyframes
+  pthread_mutex_lock(&mMutexWork);
+  for(unsigned int i=0; i<mvpKeyFrameQueue.size(); i++)
+    Map::DeleteKeyFrame(mvpKeyFrameQueue[i]);
+  mvpKeyFrameQueue.clear();
+  pthread_mutex_unlock(&mMutexWork);
   mbBundleRunning = false;
   mbBundleConverged_Full = true;
   mbBundleConverged_Recent = true;
+  mbBundleAbortRequested = false;
+  pthread_mutex_lock(&mMutexWork);
   mbResetDone = true;
   mbResetRequested = false;
-  mbBundleAbortRequested = false;
+  pthread_cond_broadcast(&mcondResetDone);
+  pthread_mutex_unlock(&mMutexWork);
 }
 
 // CHECK_RESET is a handy macro which makes the mapmaker thread stop
@@ -72,7 +90,7 @@ void MapMaker::run()
   while(!shouldStop())  // ShouldStop is a CVD::Thread func which return true if the thread is told to exit.
     {
       CHECK_RESET;
-      sleep(5); // Sleep not really necessary, especially if mapmaker is busy
+      WaitForWork();
       CHECK_RESET;
       
       // Handle any GUI commands encountered..
@@ -85,6 +103,9 @@ void MapMaker::run()
       if(!mMap.IsGood())  // Nothing to do if there is no map yet!
 	continue;
       
+      // The tracker is doing without the keyframes it found in cold storage until they're back.
+      DecompressWantedKeyFrames();
+      
       // From here on, mapmaker does various map-maintenance jobs in a certain priority
       // Hierarchy. For example, if there's a new key-frame to be added (QueueSize() is >0)
       // then that takes high priority.
@@ -112,10 +133,23 @@ void MapMaker::run()
       CHECK_RESET;
       HandleBadPoints();
       
+      CHECK_RESET;
+      // Low priority: keep the images of keyframes which haven't been used for a while compressed
+      if(QueueSize() == 0)
+	CompressColdKeyFrames();
+      
       CHECK_RESET;
       // Any new key-frames to be added?
       if(QueueSize() > 0)
 	AddKeyFrameFromTopOfQueue(); // Integrate into map data struct, and process
+      
+      // Delete the trashed points etc. which the tracker can't see any more. Queued keyframes
+      // carry point pointers outside of the tracker's snapshot, so only do this if there are none;
+      // it's enough for the queue to be empty after the readers were looked at, as any keyframe
+      // queued since then was made by a reader we've already accounted for.
+      unsigned int nSafeEpoch = mMap.MinReaderEpoch();
+      if(QueueSize() == 0)
+	mMap.ReclaimGarbage(nSafeEpoch);
     }
 }
 
@@ -123,13 +157,82 @@ void MapMaker::run()
 // Tracker calls this to demand a reset
 void MapMaker::RequestReset()
 {
+  pthread_mutex_lock(&mMutexWork);
   mbResetDone = false;
   mbResetRequested = true;
+  pthread_mutex_unlock(&mMutexWork);
+  WakeUp();
+}
+
+// The tracker calls this after TryLockImages() failed on some keyframes.
+void MapMaker::RequestDecompression()
+{
+  pthread_mutex_lock(&mMutexWork);
+  mbDecompressionRequested = true;
+  pthread_mutex_unlock(&mMutexWork);
+  WakeUp();
 }
 
 bool MapMaker::ResetDone()
 {
-  return mbResetDone;
+  pthread_mutex_lock(&mMutexWork);
+  bool bDone = mbResetDone;
+  pthread_mutex_unlock(&mMutexWork);
+  return bDone;
+}
+
+// The tracker waits for its reset request to be carried out with this.
+// This may take some time, since the mapmaker thread may have to wait
+// for an abort-check during calculation.
+void MapMaker::WaitForResetDone()
+{
+  pthread_mutex_lock(&mMutexWork);
+  while(!mbResetDone)
+    pthread_cond_wait(&mcondResetDone, &mMutexWork);
+  pthread_mutex_unlock(&mMutexWork);
+}
+
+// Gives the mapmaker thread a nudge: there is something new for it to look at.
+void MapMaker::WakeUp()
+{
+  pthread_mutex_lock(&mMutexWork);
+  mbWorkSignalled = true;
+  pthread_cond_signal(&mcondWork);
+  pthread_mutex_unlock(&mMutexWork);
+}
+
+// Is there map maintenance left to do, even if nothing new comes in?
+// Mapmaker thread only.
+bool MapMaker::HaveBackgroundWork()
+{
+  if(!mMap.IsGood())
+    return false;
+  return !mbBundleConverged_Recent || !mbBundleConverged_Full || !mqNewQueue.empty() || !mvFailureQueue.empty();
+}
+
+// The mapmaker thread's pause between two passes of its loop. While there is background
+// work, this is a short breather as it always was (the low-priority jobs get their turn
+// by chance, once in a while); otherwise the thread sleeps until woken, or until
+// MapMaker.IdleWakeSeconds have passed, which is for the checks that depend on time or
+// on the tracker's point statistics (cold keyframes, bad points.)
+void MapMaker::WaitForWork()
+{
+  static gvar3<double> gvdIdleWake("MapMaker.IdleWakeSeconds", MAPMAKER_IDLE_WAKE_SECONDS_DEFAULT, SILENT);
+  double dTimeout = HaveBackgroundWork() ? 0.005 : *gvdIdleWake;
+  
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  double dWakeTime = tv.tv_sec + 1e-6 * tv.tv_usec + dTimeout;
+  timespec ts;
+  ts.tv_sec = (time_t) dWakeTime;
+  ts.tv_nsec = (long) (1e9 * (dWakeTime - ts.tv_sec));
+  
+  pthread_mutex_lock(&mMutexWork);
+  while(!mbWorkSignalled)
+    if(pthread_cond_timedwait(&mcondWork, &mMutexWork, &ts) == ETIMEDOUT)
+      break;
+  mbWorkSignalled = false;
+  pthread_mutex_unlock(&mMutexWork);
 }
 
 // HandleBadPoints() Does some heuristic checks on all points in the map to see if 
@@ -140,34 +243,107 @@ void MapMaker::HandleBadPoints()
   for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
     {
       MapPoint &p = *mMap.vpPoints[i];
-      if(p.nMEstimatorOutlierCount > 20 && p.nMEstimatorOutlierCount > p.nMEstimatorInlierCount)
+      int nOutliers = p.MEstimatorOutlierCount();
+      if(nOutliers > 20 && nOutliers > p.MEstimatorInlierCount())
 	p.bBad = true;
     }
   
   // All points marked as bad will be erased - erase all records of them
-  // from keyframes in which they might have been measured.
+  // from keyframes in which they were measured.
+  bool bAnyBad = false;
   for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
     if(mMap.vpPoints[i]->bBad)
       {
 	MapPoint *p = mMap.vpPoints[i];
-	for(unsigned int j=0; j<mMap.vpKeyFrames.size(); j++)
-	  {
-	    KeyFrame &k = *mMap.vpKeyFrames[j];
-	    if(k.mMeasurements.count(p))
-	      k.mMeasurements.erase(p);
-	  }
+	std::vector<KeyFrame*> &vpKFs = p->pMMData->vpMeasurementKFs;
+	for(unsigned int j=0; j<vpKFs.size(); j++)
+	  vpKFs[j]->mMeasurements.erase(p);
+	delete p->pMMData;
+	p->pMMData = NULL;
+	bAnyBad = true;
       }
+  if(!bAnyBad)
+    return;
+  
+  // The trash gets deleted once the tracker is done with it, so the mapmaker's
+  // own queues mustn't keep pointers to bad points either.
+  vector<pair<KeyFrame*, MapPoint*> > vFailures;
+  for(unsigned int i=0; i<mvFailureQueue.size(); i++)
+    if(!mvFailureQueue[i].second->bBad)
+      vFailures.push_back(mvFailureQueue[i]);
+  mvFailureQueue.swap(vFailures);
+  for(unsigned int n = mqNewQueue.size(); n > 0; n--)
+    {
+      MapPoint *p = mqNewQueue.front();
+      mqNewQueue.pop();
+      if(!p->bBad)
+	mqNewQueue.push(p);
+    }
+  
   // Move bad points to the trash list.
   mMap.MoveBadPointsToTrash();
 }
 
+// CompressColdKeyFrames() puts the level images of one keyframe which
+// hasn't been used for MapMaker.ColdKeyFrameSeconds into cold storage
+// (one per call, so that new keyframes don't have to wait.) The newest
+// keyframe is always left alone. Zero seconds turns this off.
+void MapMaker::CompressColdKeyFrames()
+{
+  static gvar3<double> gvdColdSeconds("MapMaker.ColdKeyFrameSeconds", MAPMAKER_COLD_KEYFRAME_SECONDS_DEFAULT, SILENT);
+  if(*gvdColdSeconds <= 0.0 || mMap.vpKeyFrames.size() < 2)
+    return;
+  
+  double dNow = timer.get_time();
+  for(unsigned int i=0; i<mMap.vpKeyFrames.size() - 1; i++)
+    {
+      KeyFrame &k = *mMap.vpKeyFrames[i];
+      pthread_mutex_lock(&k.mutexImages.mutex);  // The tracker may be touching it.
+      bool bCompressed = k.bImagesCompressed;
+      double dLastUsed = k.dImagesLastUsed;
+      pthread_mutex_unlock(&k.mutexImages.mutex);
+      if(!bCompressed && dNow - dLastUsed > *gvdColdSeconds)
+	{
+	  k.CompressImages();
+	  return;
+	}
+    }
+}
+
+// Decompresses the keyframes which the tracker wanted (see KeyFrame::TryLockImages), if it
+// asked for that. The tracker can't hand over keyframe pointers, which might be gone by the
+// time they're looked at, so it marks the keyframes themselves.
+void MapMaker::DecompressWantedKeyFrames()
+{
+  pthread_mutex_lock(&mMutexWork);
+  bool bRequested = mbDecompressionRequested;
+  mbDecompressionRequested = false;
+  pthread_mutex_unlock(&mMutexWork);
+  if(!bRequested)
+    return;
+  
+  for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
+    {
+      KeyFrame &k = *mMap.vpKeyFrames[i];
+      pthread_mutex_lock(&k.mutexImages.mutex);
+      bool bWanted = k.bImagesWanted;
+      pthread_mutex_unlock(&k.mutexImages.mutex);
+      if(bWanted)
+	k.UseImages();
+    }
+}
+
 MapMaker::~MapMaker()
 {
   mbBundleAbortRequested = true;
   stop(); // makes shouldStop() return true
+  WakeUp();
   cout << "Waiting for mapmaker to die.." << endl;
   join();
   cout << " .. mapmaker has died." << endl;
+  pthread_cond_destroy(&mcondResetDone);
+  pthread_cond_destroy(&mcondWork);
+  pthread_mutex_destroy(&mMutexWork);
 }
 
 
@@ -311,7 +487,7 @@ bool MapMaker::InitFromStereo(KeyFrame &kF,
       mFirst.v2RootPos = vec(vTrailMatches[i].first);
       mFirst.bSubPix = true;
       pkFirst->mMeasurements[p] = mFirst;
-      p->pMMData->sMeasurementKFs.insert(pkFirst);
+      p->pMMData->AddMeasurementKF(pkFirst);
       
       Measurement mSecond;
       mSecond.nLevel = 0;
@@ -319,13 +495,14 @@ bool MapMaker::InitFromStereo(KeyFrame &kF,
       mSecond.v2RootPos = finder.GetSubPixPos();
       mSecond.bSubPix = true;
       pkSecond->mMeasurements[p] = mSecond;
-      p->pMMData->sMeasurementKFs.insert(pkSecond);
+      p->pMMData->AddMeasurementKF(pkSecond);
     }
   
   mMap.vpKeyFrames.push_back(pkFirst);
   mMap.vpKeyFrames.push_back(pkSecond);
-  pkFirst->MakeKeyFrame_Rest();
-  pkSecond->MakeKeyFrame_Rest();
+  mMap.RefreshKeyFrameCentres();
+  pkFirst->MakeKeyFrame_Rest(KeyFrameWorkerPool());   // (Called from the tracker thread.)
+  pkSecond->MakeKeyFrame_Rest(KeyFrameWorkerPool());
   
   for(int i=0; i<5; i++)
     BundleAdjustAll();
@@ -363,6 +540,7 @@ bool MapMaker::InitFromStereo(KeyFrame &kF,
   initialScaleFactor *= pkFirst->dSceneDepthMean;
   ApplyGlobalTransformationToMap(KFZeroDesiredCamFromWorld.inverse());
   
+  mMap.Publish();
   mMap.bGood = true;
   se3TrackerPose = pkSecond->se3CfromW;
 
@@ -406,34 +584,36 @@ void MapMaker::ThinCandidates(KeyFrame &k, int nLevel)
 {
   vector<Candidate> &vCSrc = k.aLevels[nLevel].vCandidates;
   vector<Candidate> vCGood;
-  vector<ImageRef> irBusyLevelPos;
-  // Make a list of `busy' image locations, which already have features at the same level
-  // or at one level higher.
+  
+  // Only keep those candidates further than 5 pixels away from `busy' image locations, 
+  // which already have features at the same level or at one level higher. 
+  // Rather than checking each candidate against each busy location, mark all the pixels 
+  // within the radius of a busy location in a bitmap, and then just look up the candidates.
+  const int nRadius = 5;
+  // The bitmap is the size of the level, so take it from the pool; pooled buffers have
+  // been used before, and need clearing.
+  ImageRef irSize = k.aLevels[nLevel].im.size();
+  Image<byte> imBusy;
+  ImagePool<byte>::Instance().Resize(imBusy, irSize);
+  imBusy.fill(0);
   for(meas_it it = k.mMeasurements.begin(); it!=k.mMeasurements.end(); it++)
     {
       if(!(it->second.nLevel == nLevel || it->second.nLevel == nLevel + 1))
 	continue;
-      irBusyLevelPos.push_back(ir_rounded(it->second.v2RootPos / LevelScale(nLevel)));
+      ImageRef irB = ir_rounded(it->second.v2RootPos / LevelScale(nLevel));
+      for(int y = max(irB.y - nRadius + 1, 0); y <= min(irB.y + nRadius - 1, irSize.y - 1); y++)
+	for(int x = max(irB.x - nRadius + 1, 0); x <= min(irB.x + nRadius - 1, irSize.x - 1); x++)
+	  if((ImageRef(x, y) - irB).mag_squared() < nRadius * nRadius)
+	    imBusy[y][x] = 1;
     }
   
-  // Only keep those candidates further than 5 pixels away from busy positions.
-  unsigned int nMinMagSquared = 5*5;
   for(unsigned int i=0; i<vCSrc.size(); i++)
     {
       ImageRef irC = vCSrc[i].irLevelPos;
-      bool bGood = true;
-      for(unsigned int j=0; j<irBusyLevelPos.size(); j++)
-	{
-	  ImageRef irB = irBusyLevelPos[j];
-	  if((irB - irC).mag_squared() < nMinMagSquared)
-	    {
-	      bGood = false;
-	      break;
-	    }
-	}
-      if(bGood)
+      if(!imBusy.in_image(irC) || !imBusy[irC])
 	vCGood.push_back(vCSrc[i]);
     } 
+  ImagePool<byte>::Instance().Release(imBusy);
   vCSrc = vCGood;
 }
 
@@ -445,6 +625,8 @@ void MapMaker::AddSomeMapPoints(int nLevel)
   KeyFrame &kSrc = *(mMap.vpKeyFrames[mMap.vpKeyFrames.size() - 1]); // The new keyframe
   KeyFrame &kTarget = *(ClosestKeyFrame(kSrc));   
   Level &l = kSrc.aLevels[nLevel];
+  kSrc.UseImages();     // Either may be in cold storage.
+  kTarget.UseImages();
 
   ThinCandidates(kSrc, nLevel);
   
@@ -457,6 +639,7 @@ void MapMaker::ApplyGlobalTransformationToMap(SE3<> se3NewFromOld)
 {
   for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
     mMap.vpKeyFrames[i]->se3CfromW = mMap.vpKeyFrames[i]->se3CfromW * se3NewFromOld.inverse();
+  mMap.RefreshKeyFrameCentres();
   
   //SO3<> so3Rot = se3NewFromOld.get_rotation();
   for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
@@ -474,6 +657,7 @@ void MapMaker::ApplyGlobalScaleToMap(double dScale)
   {
     mMap.vpKeyFrames[i]->se3CfromW.get_translation() *= dScale;
   }
+  mMap.RefreshKeyFrameCentres();
   
   for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
     {
@@ -492,34 +676,50 @@ void MapMaker::ApplyGlobalScaleToMap(double dScale)
 // The tracker entry point for adding a new keyframe;
 // the tracker thread doesn't want to hang about, so 
 // just dumps it on the top of the mapmaker's queue to 
-// be dealt with later, and return.
+// be dealt with later, and return. The keyframe's pyramid
+// and measurements are taken over rather than copied, so
+// k is left without them.
 void MapMaker::AddKeyFrame(KeyFrame &k)
 {
   KeyFrame *pK = new KeyFrame;
-  *pK = k;
-  pK->pSBI = NULL; // Mapmaker uses a different SBI than the tracker, so will re-gen its own
+  pK->TakeOver(k);  // Mapmaker uses a different SBI than the tracker, so pSBI stays NULL and it will re-gen its own
+  pthread_mutex_lock(&mMutexWork);
   mvpKeyFrameQueue.push_back(pK);
+  pthread_mutex_unlock(&mMutexWork);
   if(mbBundleRunning)   // Tell the mapmaker to stop doing low-priority stuff and concentrate on this KF first.
     mbBundleAbortRequested = true;
+  WakeUp();
 }
 
 // Mapmaker's code to handle incoming key-frames.
 void MapMaker::AddKeyFrameFromTopOfQueue()
 {
+  pthread_mutex_lock(&mMutexWork);
   if(mvpKeyFrameQueue.size() == 0)
-    return;
-  
+    {
+      pthread_mutex_unlock(&mMutexWork);
+      return;
+    }
   KeyFrame *pK = mvpKeyFrameQueue[0];
   mvpKeyFrameQueue.erase(mvpKeyFrameQueue.begin());
-  pK->MakeKeyFrame_Rest();
+  pthread_mutex_unlock(&mMutexWork);
+  
+  pK->MakeKeyFrame_Rest(MapMakerWorkerPool());
   mMap.vpKeyFrames.push_back(pK);
-  // Any measurements? Update the relevant point's measurement counter status map
+  mMap.RefreshKeyFrameCentres();
+  // Any measurements? Update the relevant point's measurement counter status map.
+  // Points may have gone bad since the tracker measured them; forget those.
   for(meas_it it = pK->mMeasurements.begin();
-      it!=pK->mMeasurements.end();
-      it++)
+      it!=pK->mMeasurements.end();)
     {
-      it->first->pMMData->sMeasurementKFs.insert(pK);
+      if(it->first->bBad)
+	{
+	  pK->mMeasurements.erase(it++);
+	  continue;
+	}
+      it->first->pMMData->AddMeasurementKF(pK);
       it->second.Source = Measurement::SRC_TRACKER;
+      it++;
     }
   
   // And maybe we missed some - this now adds to the map itself, too.
@@ -532,6 +732,7 @@ void MapMaker::AddKeyFrameFromTopOfQueue()
   
   mbBundleConverged_Full = false;
   mbBundleConverged_Recent = false;
+  mMap.Publish();
 }
 
 // Tries to make a new map point out of a single candidate point
@@ -546,7 +747,7 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
   static bool bMadeCache = false;
   if(!bMadeCache)
     {
-      imUnProj.resize(kSrc.aLevels[0].im.size());
+      ImagePool<Vector<2> >::Instance().Resize(imUnProj, kSrc.aLevels[0].im.size());
       ImageRef ir;
       do imUnProj[ir] = mCamera.UnProject(ir);
       while(ir.next(imUnProj.size()));
@@ -686,8 +887,8 @@ bool MapMaker::AddPointEpipolar(KeyFrame &kSrc,
   m.Source = Measurement::SRC_EPIPOLAR;
   m.v2RootPos = Finder.GetSubPixPos();
   kTarget.mMeasurements[pNew] = m;
-  pNew->pMMData->sMeasurementKFs.insert(&kSrc);
-  pNew->pMMData->sMeasurementKFs.insert(&kTarget);
+  pNew->pMMData->AddMeasurementKF(&kSrc);
+  pNew->pMMData->AddMeasurementKF(&kTarget);
   return true;
 }
 
@@ -700,56 +901,30 @@ double MapMaker::KeyFrameLinearDist(KeyFrame &k1, KeyFrame &k2)
   return dDist;
 }
 
+// The neighbour queries go through the map's tree of camera centres, which
+// has to be up to date: see RefreshKeyFrameCentres().
 vector<KeyFrame*> MapMaker::NClosestKeyFrames(KeyFrame &k, unsigned int N)
 {
-  vector<pair<double, KeyFrame* > > vKFandScores;
-  for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
-    {
-      if(mMap.vpKeyFrames[i] == &k)
-	continue;
-      double dDist = KeyFrameLinearDist(k, *mMap.vpKeyFrames[i]);
-      vKFandScores.push_back(make_pair(dDist, mMap.vpKeyFrames[i]));
-    }
-  if(N > vKFandScores.size())
-    N = vKFandScores.size();
-  partial_sort(vKFandScores.begin(), vKFandScores.begin() + N, vKFandScores.end());
+  vector<pair<double, int> > vClosest;
+  mMap.KeyFrameCentres.NClosest(k.se3CfromW.inverse().get_translation(), N, &k, vClosest);
   
   vector<KeyFrame*> vResult;
-  for(unsigned int i=0; i<N; i++)
-    vResult.push_back(vKFandScores[i].second);
+  for(unsigned int i=0; i<vClosest.size(); i++)
+    vResult.push_back(mMap.KeyFrameCentres.GetKeyFrame(vClosest[i].second));
   return vResult;
 }
 
 KeyFrame* MapMaker::ClosestKeyFrame(KeyFrame &k)
 {
-  double dClosestDist = 9999999999.9;
-  int nClosest = -1;
-  for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
-    {
-      if(mMap.vpKeyFrames[i] == &k)
-	continue;
-      double dDist = KeyFrameLinearDist(k, *mMap.vpKeyFrames[i]);
-      if(dDist < dClosestDist)
-	{
-	  dClosestDist = dDist;
-	  nClosest = i;
-	}
-    }
-  assert(nClosest != -1);
-  return mMap.vpKeyFrames[nClosest];
-}
-
-double MapMaker::DistToNearestKeyFrame(KeyFrame &kCurrent)
-{
-  KeyFrame *pClosest = ClosestKeyFrame(kCurrent);
-  double dDist = KeyFrameLinearDist(kCurrent, *pClosest);
-  return dDist;
+  vector<pair<double, int> > vClosest;
+  mMap.KeyFrameCentres.NClosest(k.se3CfromW.inverse().get_translation(), 1, &k, vClosest);
+  assert(vClosest.size() == 1);
+  return mMap.KeyFrameCentres.GetKeyFrame(vClosest[0].second);
 }
 
-bool MapMaker::NeedNewKeyFrame(KeyFrame &kCurrent)
+bool MapMaker::NeedNewKeyFrame(KeyFrame &kCurrent, const MapSnapshot &Snap)
 {
-  KeyFrame *pClosest = ClosestKeyFrame(kCurrent);
-  double dDist = KeyFrameLinearDist(kCurrent, *pClosest);	// distance in PTAMS system.
+  double dDist = Snap.DistToNearestKeyFrame(kCurrent.se3CfromW.inverse().get_translation());	// distance in PTAMS system.
   lastMetricDist = dDist * currentScaleFactor;
   lastWiggleDist = dDist / kCurrent.dSceneDepthMean;
 
@@ -916,6 +1091,7 @@ void MapMaker::BundleAdjust(set<KeyFrame*> sAdjustSet, set<KeyFrame*> sFixedSet,
       if(bRecent)
 	mbBundleConverged_Recent = false;
       mbBundleConverged_Full = false;
+      mMap.Publish();   // The tracker sees all of the update from its next frame on, never half of it
     };
   
   if(b.Converged())
@@ -945,7 +1121,7 @@ void MapMaker::BundleAdjust(set<KeyFrame*> sAdjustSet, set<KeyFrame*> sFixedSet,
 	  else
 	    pp->pMMData->sNeverRetryKFs.insert(pk);
 	  pk->mMeasurements.erase(pp);
-	  pp->pMMData->sMeasurementKFs.erase(pk);
+	  pp->pMMData->RemoveMeasurementKF(pk);
 	}
     }
 }
@@ -956,14 +1132,23 @@ void MapMaker::BundleAdjust(set<KeyFrame*> sAdjustSet, set<KeyFrame*> sFixedSet,
 // much like the tracker! So most of the code looks just like in 
 // TrackerData.h.
 bool MapMaker::ReFind_Common(KeyFrame &k, MapPoint &p)
+{
+  vector<ReFindSearch> vSearches;
+  if(!ReFind_Project(k, p, vSearches))
+    return false;
+  return ReFind_Searches(vSearches) > 0;
+}
+
+// The first pass of re-finding: is point p in keyframe k's view at all?
+// Pairs which can't be are marked as never to be retried; otherwise, a search is queued.
+bool MapMaker::ReFind_Project(KeyFrame &k, MapPoint &p, vector<ReFindSearch> &vSearches)
 {
   // abort if either a measurement is already in the map, or we've
   // decided that this point-kf combo is beyond redemption
-  if(p.pMMData->sMeasurementKFs.count(&k)
+  if(p.pMMData->IsMeasuredIn(&k)
      || p.pMMData->sNeverRetryKFs.count(&k))
     return false;
   
-  static PatchFinder Finder;
   Vector<3> v3Cam = k.se3CfromW*p.v3WorldPos;
   if(v3Cam[2] < 0.001)
     {
@@ -984,6 +1169,7 @@ bool MapMaker::ReFind_Common(KeyFrame &k, MapPoint &p)
       return false;
     }
 
+  k.UseImages();  // Only now the keyframe's images are needed: they may be in cold storage.
   ImageRef irImageSize = k.aLevels[0].im.size();
   if(v2Image[0] < 0 || v2Image[1] < 0 || v2Image[0] > irImageSize[0] || v2Image[1] > irImageSize[1])
     {
@@ -991,24 +1177,31 @@ bool MapMaker::ReFind_Common(KeyFrame &k, MapPoint &p)
       return false;
     }
   
-  Matrix<2> m2CamDerivs = mCamera.GetProjectionDerivs();
-  Finder.MakeTemplateCoarse(p, k.se3CfromW, m2CamDerivs);
-  
+  ReFindSearch s;
+  s.pKF = &k;
+  s.pPoint = &p;
+  s.v2Image = v2Image;
+  s.m2CamDerivs = mCamera.GetProjectionDerivs();
+  s.bFound = false;
+  vSearches.push_back(s);
+  return true;
+}
+
+// The second pass: the patch search. This only reads the map, so any number of 
+// these can run at once, as long as each has a PatchFinder of its own.
+static void ReFind_Search(PatchFinder &Finder, ReFindSearch &s)
+{
+  KeyFrame &k = *s.pKF;
+  Finder.MakeTemplateCoarse(*s.pPoint, k.se3CfromW, s.m2CamDerivs);
   if(Finder.TemplateBad())
-    {
-      p.pMMData->sNeverRetryKFs.insert(&k);
-      return false;
-    }
+    return;
   
-  bool bFound = Finder.FindPatchCoarse(ir(v2Image), k, 4);  // Very tight search radius!
+  bool bFound = Finder.FindPatchCoarse(ir(s.v2Image), k, 4);  // Very tight search radius!
   if(!bFound)
-    {
-      p.pMMData->sNeverRetryKFs.insert(&k);
-      return false;
-    }
+    return;
   
-  // If we found something, generate a measurement struct and put it in the map
-  Measurement m;
+  // If we found something, generate a measurement struct
+  Measurement &m = s.m;
   m.nLevel = Finder.GetLevel();
   m.Source = Measurement::SRC_REFIND;
   
@@ -1024,30 +1217,82 @@ bool MapMaker::ReFind_Common(KeyFrame &k, MapPoint &p)
       m.v2RootPos = Finder.GetCoarsePosAsVector();
       m.bSubPix = false;
     };
+  s.bFound = true;
+}
+
+// A worker pool job: a contiguous share of the searches.
+struct ReFindJob : public Runnable
+{
+  ReFindJob(vector<ReFindSearch> &v, int nStart, int nEnd)
+    : pvSearches(&v), nStart(nStart), nEnd(nEnd) {}
+  virtual void run() 
+  { 
+    for(int i=nStart; i<nEnd; i++)
+      ReFind_Search(Finder, (*pvSearches)[i]);
+  }
+  
+  vector<ReFindSearch> *pvSearches;
+  int nStart, nEnd;
+  PatchFinder Finder;
+};
+
+// Runs the queued searches, and then puts the measurements which were found into the
+// map, in the order of the queue. Returns how many were found.
+int MapMaker::ReFind_Searches(vector<ReFindSearch> &vSearches)
+{
+  WorkerPool *pPool = MapMakerWorkerPool();
+  if(!pPool || vSearches.size() < 2)
+    {
+      static PatchFinder Finder;
+      for(unsigned int i=0; i<vSearches.size(); i++)
+	ReFind_Search(Finder, vSearches[i]);
+    }
+  else
+    {
+      int nJobs = min((int) vSearches.size(), pPool->NumThreads() + 1);
+      vector<ReFindJob*> vpJobs;
+      vector<Runnable*> vpRunnables;
+      for(int i=0; i<nJobs; i++)
+	{
+	  vpJobs.push_back(new ReFindJob(vSearches, vSearches.size() * i / nJobs, vSearches.size() * (i + 1) / nJobs));
+	  vpRunnables.push_back(vpJobs.back());
+	}
+      pPool->Run(vpRunnables);
+      for(int i=0; i<nJobs; i++)
+	delete vpJobs[i];
+    }
   
-  if(k.mMeasurements.count(&p))
+  int nFound = 0;
+  for(unsigned int i=0; i<vSearches.size(); i++)
     {
-      assert(0); // This should never happen, we checked for this at the start.
+      ReFindSearch &s = vSearches[i];
+      if(!s.bFound)
+	{
+	  s.pPoint->pMMData->sNeverRetryKFs.insert(s.pKF);
+	  continue;
+	}
+      if(s.pKF->mMeasurements.count(s.pPoint))
+	{
+	  assert(0); // This should never happen, ReFind_Project checked for this.
+	}
+      s.pKF->mMeasurements[s.pPoint] = s.m;
+      s.pPoint->pMMData->AddMeasurementKF(s.pKF);
+      nFound++;
     }
-  k.mMeasurements[&p] = m;
-  p.pMMData->sMeasurementKFs.insert(&k);
-  return true;
+  return nFound;
 }
 
 // A general data-association update for a single keyframe
 // Do this on a new key-frame when it's passed in by the tracker
 int MapMaker::ReFindInSingleKeyFrame(KeyFrame &k)
 {
-  vector<MapPoint*> vToFind;
+  // Most points aren't in the keyframe's view: the cheap first pass gets rid of those,
+  // and only the rest are searched for.
+  vector<ReFindSearch> vSearches;
   for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
-    vToFind.push_back(mMap.vpPoints[i]);
+    ReFind_Project(k, *mMap.vpPoints[i], vSearches);
   
-  int nFoundNow = 0;
-  for(unsigned int i=0; i<vToFind.size(); i++)
-    if(ReFind_Common(k,*vToFind[i]))
-      nFoundNow++;
-
-  return nFoundNow;
+  return ReFind_Searches(vSearches);
 };
 
 // When new map points are generated, they're only created from a stereo pair
@@ -1059,18 +1304,25 @@ void MapMaker::ReFindNewlyMade()
     return;
   int nFound = 0;
   int nBad = 0;
-  while(!mqNewQueue.empty() && mvpKeyFrameQueue.size() == 0)
+  // The points are searched for a few at a time, so that a new keyframe 
+  // from the tracker doesn't have to wait for the whole queue.
+  const int nPointsPerBatch = 16;
+  while(!mqNewQueue.empty() && QueueSize() == 0)
     {
-      MapPoint* pNew = mqNewQueue.front();
-      mqNewQueue.pop();
-      if(pNew->bBad)
+      vector<ReFindSearch> vSearches;
+      for(int n=0; n<nPointsPerBatch && !mqNewQueue.empty(); n++)
 	{
-	  nBad++;
-	  continue;
+	  MapPoint* pNew = mqNewQueue.front();
+	  mqNewQueue.pop();
+	  if(pNew->bBad)
+	    {
+	      nBad++;
+	      continue;
+	    }
+	  for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
+	    ReFind_Project(*mMap.vpKeyFrames[i], *pNew, vSearches);
 	}
-      for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
-	if(ReFind_Common(*mMap.vpKeyFrames[i], *pNew))
-	  nFound++;
+      nFound += ReFind_Searches(vSearches);
     }
 };
 
@@ -1090,9 +1342,17 @@ void MapMaker::ReFindFromFailureQueue()
 };
 
 // Is the tracker's camera pose in cloud-cuckoo land?
-bool MapMaker::IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent)
+bool MapMaker::IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent, const MapSnapshot &Snap)
+{
+  return Snap.DistToNearestKeyFrame(kCurrent.se3CfromW.inverse().get_translation()) > mdWiggleScale * 10.0;
+}
+
+int MapMaker::QueueSize()
 {
-  return DistToNearestKeyFrame(kCurrent) > mdWiggleScale * 10.0;
+  pthread_mutex_lock(&mMutexWork);
+  int nSize = mvpKeyFrameQueue.size();
+  pthread_mutex_unlock(&mMutexWork);
+  return nSize;
 }
 
 // Find a dominant plane in the map, find an SE3<> to put it as the z=0 plane
@@ -1228,6 +1488,7 @@ void MapMaker::GUICommandCallBack(void* ptr, string sCommand, string sParams)
   c.sCommand = sCommand;
   c.sParams = sParams;
   ((MapMaker*) ptr)->mvQueuedCommands.push_back(c);
+  ((MapMaker*) ptr)->WakeUp();
 }
 
 void MapMaker::GUICommandHandler(string sCommand, string sParams)  // Called by the callback func..
@@ -1260,6 +1521,18 @@ void MapMaker::GUICommandHandler(string sCommand, string sParams)  // Called by
       return;
     }
   
+  if(sCommand=="ImagePoolStats")
+    {
+      PrintImagePoolStats(cout);
+      return;
+    }
+  
+  if(sCommand=="ColdStorageStats")
+    {
+      PrintColdStorageStats(cout);
+      return;
+    }
+  
   cout << "! MapMaker::GUICommandHandler: unhandled command "<< sCommand << endl;
   exit(1);
 }; 
@@ -16,11 +16,13 @@
 #include <cvd/image.h>
 #include <cvd/byte.h>
 #include <cvd/thread.h>
+#include <pthread.h>
 
 #include "Map.h"
 #include "KeyFrame.h"
 #include "ATANCamera.h"
 #include <queue>
+#include <algorithm>
 
 
 // Each MapPoint has an associated MapMakerData class
@@ -28,10 +30,37 @@
  
 struct MapMakerData
 {
-  std::set<KeyFrame*> sMeasurementKFs;   // Which keyframes has this map point got measurements in?
+  // Which keyframes has this map point got measurements in? This must be kept in step with 
+  // the keyframes' mMeasurements, so only change it with the functions below. Unordered;
+  // a point is only measured in a few keyframes, so a plain vector is the fastest thing to search.
+  std::vector<KeyFrame*> vpMeasurementKFs;
   std::set<KeyFrame*> sNeverRetryKFs;    // Which keyframes have measurements failed enough so I should never retry?
+  inline bool IsMeasuredIn(KeyFrame *pK)
+  {  return std::find(vpMeasurementKFs.begin(), vpMeasurementKFs.end(), pK) != vpMeasurementKFs.end(); }
+  inline void AddMeasurementKF(KeyFrame *pK)
+  {  if(!IsMeasuredIn(pK)) vpMeasurementKFs.push_back(pK); }
+  inline void RemoveMeasurementKF(KeyFrame *pK)
+  {
+    std::vector<KeyFrame*>::iterator it = std::find(vpMeasurementKFs.begin(), vpMeasurementKFs.end(), pK);
+    if(it == vpMeasurementKFs.end())
+      return;
+    *it = vpMeasurementKFs.back();
+    vpMeasurementKFs.pop_back();
+  }
   inline int GoodMeasCount()            
-  {  return sMeasurementKFs.size(); }
+  {  return vpMeasurementKFs.size(); }
+};
+
+// A patch search for a map point in a keyframe, as queued by the first pass of re-finding
+// (see MapMaker::ReFind_Project), with its result.
+struct ReFindSearch
+{
+  KeyFrame *pKF;
+  MapPoint *pPoint;
+  Vector<2> v2Image;       // Predicted position, at level zero
+  Matrix<2> m2CamDerivs;   // Camera projection derivatives there
+  bool bFound;
+  Measurement m;           // Only valid if bFound
 };
 
 // MapMaker dervives from CVD::Thread, so everything in void run() is its own thread.
@@ -53,12 +82,15 @@ public:
 		      SE3<> &se3CameraPos);
   
   
-  void AddKeyFrame(KeyFrame &k);   // Add a key-frame to the map. Called by the tracker.
+  void AddKeyFrame(KeyFrame &k);   // Add a key-frame to the map, taking over its pyramid. Called by the tracker.
   void RequestReset();   // Request that the we reset. Called by the tracker.
+  void RequestDecompression();  // Decompress the keyframes the tracker found in cold storage. Called by the tracker.
   bool ResetDone();      // Returns true if the has been done.
-  int  QueueSize() { return mvpKeyFrameQueue.size() ;} // How many KFs in the queue waiting to be added?
-  bool NeedNewKeyFrame(KeyFrame &kCurrent);            // Is it a good camera pose to add another KeyFrame?
-  bool IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent);  // Is the camera far away from the nearest KeyFrame (i.e. maybe lost?)
+  void WaitForResetDone(); // Blocks until it has.
+  int  QueueSize();       // How many KFs in the queue waiting to be added?
+  // These two are called by the tracker, so they look at the map through the tracker's snapshot:
+  bool NeedNewKeyFrame(KeyFrame &kCurrent, const MapSnapshot &Snap);            // Is it a good camera pose to add another KeyFrame?
+  bool IsDistanceToNearestKeyFrameExcessive(KeyFrame &kCurrent, const MapSnapshot &Snap);  // Is the camera far away from the nearest KeyFrame (i.e. maybe lost?)
   
   double initialScaleFactor;
   double currentScaleFactor;	// set exgternally for metric scale.
@@ -97,12 +129,18 @@ protected:
   void ReFindNewlyMade();
   void ReFindAll();
   bool ReFind_Common(KeyFrame &k, MapPoint &p);
+  // Re-finding goes in passes: ReFind_Project() does the cheap checks of whether a point can be 
+  // in a keyframe's view at all, and queues a search if so; ReFind_Searches() then runs the
+  // queued searches, in parallel if there are worker threads, and adds what was found to the map.
+  bool ReFind_Project(KeyFrame &k, MapPoint &p, std::vector<ReFindSearch> &vSearches);
+  int ReFind_Searches(std::vector<ReFindSearch> &vSearches);
   void SubPixelRefineMatches(KeyFrame &k, int nLevel);
   
   // General Maintenance/Utility:
   void Reset();
   void HandleBadPoints();
-  double DistToNearestKeyFrame(KeyFrame &kCurrent);
+  void CompressColdKeyFrames();
+  void DecompressWantedKeyFrames();
   double KeyFrameLinearDist(KeyFrame &k1, KeyFrame &k2);
   KeyFrame* ClosestKeyFrame(KeyFrame &k);
   std::vector<KeyFrame*> NClosestKeyFrames(KeyFrame &k, unsigned int N);
@@ -117,7 +155,7 @@ protected:
   
 
   // Member variables:
-  std::vector<KeyFrame*> mvpKeyFrameQueue;  // Queue of keyframes from the tracker waiting to be processed
+  std::vector<KeyFrame*> mvpKeyFrameQueue;  // Queue of keyframes from the tracker waiting to be processed; guarded by mMutexWork
   std::vector<std::pair<KeyFrame*, MapPoint*> > mvFailureQueue; // Queue of failed observations to re-find
   std::queue<MapPoint*> mqNewQueue;   // Queue of newly-made map points to re-find in other KeyFrames
   
@@ -136,6 +174,18 @@ protected:
   bool mbBundleAbortRequested;      // We should stop bundle adjustment
   bool mbBundleRunning;             // Bundle adjustment is running
   bool mbBundleRunningIsRecent;     //    ... and it's a local bundle adjustment.
+  
+  // The mapmaker thread sleeps on mcondWork when there is nothing to do. Everything which
+  // gives it something to do (a keyframe, a reset request, a GUI command, thread stop)
+  // calls WakeUp(). mMutexWork also guards the reset handshake's mbResetDone.
+  void WakeUp();
+  void WaitForWork();
+  bool HaveBackgroundWork();
+  pthread_mutex_t mMutexWork;
+  pthread_cond_t mcondWork;
+  pthread_cond_t mcondResetDone;
+  bool mbWorkSignalled;             // WakeUp() was called since the last WaitForWork()
+  bool mbDecompressionRequested;    // RequestDecompression() was called; guarded by mMutexWork
 
   
 };
@@ -1,6 +1,9 @@
 // Copyright 2008 Isis Innovation Limited
 #include "MapPoint.h"
 #include "KeyFrame.h"
+
+unsigned int MapPoint::nNextID = 0;
+
 void MapPoint::RefreshPixelVectors()
 {
   KeyFrame &k = *pPatchSourceKF;
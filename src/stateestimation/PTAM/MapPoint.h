@@ -20,7 +20,6 @@ using namespace TooN;
 #include <set>
 
 class KeyFrame;
-class TrackerData;
 class MapMakerData;
 
 struct MapPoint
@@ -29,7 +28,7 @@ struct MapPoint
   inline MapPoint()
   {
     bBad = false;
-    pTData = NULL;
+    nID = nNextID++;
     pMMData = NULL;
     nMEstimatorOutlierCount = 0;
     nMEstimatorInlierCount = 0;
@@ -62,12 +61,19 @@ struct MapPoint
   // Info for the Mapmaker (not to be trashed by the tracker:)
   MapMakerData *pMMData;
   
-  // Info for the Tracker (not to be trashed by the MapMaker:)
-  TrackerData *pTData;
+  // Unique ID of the point, in order of creation. The tracker keeps its
+  // per-point info (TrackerData) in its own arena, indexed by this.
+  unsigned int nID;
+  static unsigned int nNextID;
   
-  // Info provided by the tracker for the mapmaker:
+  // Info provided by the tracker for the mapmaker. The tracker counts from its own
+  // thread while the mapmaker reads, so only touch these with the atomic functions.
   int nMEstimatorOutlierCount;
   int nMEstimatorInlierCount;
+  inline void CountMEstimatorOutlier() {__sync_fetch_and_add(&nMEstimatorOutlierCount, 1);}
+  inline void CountMEstimatorInlier()  {__sync_fetch_and_add(&nMEstimatorInlierCount, 1);}
+  inline int MEstimatorOutlierCount()  {return __sync_fetch_and_add(&nMEstimatorOutlierCount, 0);}
+  inline int MEstimatorInlierCount()   {return __sync_fetch_and_add(&nMEstimatorInlierCount, 0);}
   
   // Random junk (e.g. for visualisation)
   double dCreationTime; //timer.get_time() time of creation
@@ -3,31 +3,41 @@
 using namespace CVD;
 using namespace std;
 
-// Scoring function
-inline int MiniPatch::SSDAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRef &ir)
+// The SSD of an NxN patch, templated on N so that the loops unroll for the default 9x9 patch.
+// N = 0 is the general version, for which the size is only known at run-time.
+template<int N>
+static inline int SumSqDiff(const byte *imagepointer, long int nRowStride, const byte *templatepointer, int nRuntimeSize)
 {
-  if(!im.in_image_with_border(ir, mnHalfPatchSize))
-    return mnMaxSSD + 1;
-  ImageRef irImgBase = ir - ImageRef(mnHalfPatchSize, mnHalfPatchSize);
-  int nRows = mimOrigPatch.size().y;
-  int nCols = mimOrigPatch.size().x;
-  byte *imagepointer;
-  byte *templatepointer;
+  const int nSize = N ? N : nRuntimeSize;
   int nDiff;
   int nSumSqDiff = 0;
-  for(int nRow = 0; nRow < nRows; nRow++)
+  for(int nRow = 0; nRow < nSize; nRow++)
     {
-      imagepointer = &im[irImgBase + ImageRef(0,nRow)];
-      templatepointer = &mimOrigPatch[ImageRef(0,nRow)];
-      for(int nCol = 0; nCol < nCols; nCol++)
+      for(int nCol = 0; nCol < nSize; nCol++)
 	{
 	  nDiff = imagepointer[nCol] - templatepointer[nCol];
 	  nSumSqDiff += nDiff * nDiff;
 	};
+      imagepointer += nRowStride;
+      templatepointer += nSize;
     };
   return nSumSqDiff;
 }
 
+// Scoring function
+inline int MiniPatch::SSDAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRef &ir)
+{
+  if(!im.in_image_with_border(ir, mnHalfPatchSize))
+    return mnMaxSSD + 1;
+  ImageRef irImgBase = ir - ImageRef(mnHalfPatchSize, mnHalfPatchSize);
+  int nSize = mimOrigPatch.size().x;
+  long int nRowStride = im[1] - im[0];
+  if(nSize == 9)
+    return SumSqDiff<9>(&im[irImgBase], nRowStride, &mimOrigPatch[ImageRef(0,0)], nSize);
+  else
+    return SumSqDiff<0>(&im[irImgBase], nRowStride, &mimOrigPatch[ImageRef(0,0)], nSize);
+}
+
 // Find a patch by searching at FAST corners in an input image
 // If available, a row-corner LUT is used to speed up search through the
 // FAST corners
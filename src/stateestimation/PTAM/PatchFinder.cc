@@ -2,23 +2,102 @@
 #include "PatchFinder.h"
 #include "SmallMatrixOpts.h"
 #include "KeyFrame.h"
+#include "ImagePool.h"
 
 #include <cvd/vision.h>
 #include <cvd/vector_image_ref.h>
 #include <cvd/image_interpolate.h>
-#include <TooN/Cholesky.h>
 // tmmintrin.h contains SSE3<> instrinsics, used for the ZMSSD search at the bottom..
 // If this causes problems, just do #define CVD_HAVE_XMMINTRIN 0
 #if CVD_HAVE_XMMINTRIN
 #include <tmmintrin.h>
 #endif
+// The AVX2 coarse search is compiled in as a separate target-specific function, so the rest
+// of the code doesn't need -mavx2; whether it's used is decided at run-time. This needs
+// gcc 4.9 or later for the target attribute and the cpu-detection builtins.
+#if CVD_HAVE_XMMINTRIN && defined(__GNUC__) && !defined(__clang__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define PATCHFINDER_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define PATCHFINDER_HAVE_AVX2 0
+#endif
 
 using namespace CVD;
 using namespace std;
 
+// The plain C++ kernels of the class are templated on the patch size N, so that for the
+// 8x8 patches which PTAM uses the compiler knows all the loop bounds and unrolls them.
+// N = 0 is the general version, for which the size is only known at run-time.
+// N.B. with CVD_HAVE_XMMINTRIN (the normal build) the SSE code paths take the 8x8
+// patches before these are reached, so the <8> instances only run in builds without SSE.
+
+// Image sums and the cross sum with the template of an NxN box of im, top-left at pImage.
+template<int N>
+static inline void ZMSSDSums(const byte *pImage, long int nRowStride, const byte *pTemplate, int nRuntimeSize,
+			     int &nImageSum, int &nImageSumSq, int &nCrossSum)
+{
+  const int nSize = N ? N : nRuntimeSize;
+  for(int nRow = 0; nRow < nSize; nRow++)
+    {
+      for(int nCol = 0; nCol < nSize; nCol++)
+	{
+	  int n = pImage[nCol];
+	  nImageSum += n;
+	  nImageSumSq += n*n;
+	  nCrossSum += n * pTemplate[nCol];
+	}
+      pImage += nRowStride;
+      pTemplate += nSize;
+    }
+}
+
+// Just the cross sum
+template<int N>
+static inline int CrossSum(const byte *pImage, long int nRowStride, const byte *pTemplate, int nRuntimeSize)
+{
+  const int nSize = N ? N : nRuntimeSize;
+  int nCrossSum = 0;
+  for(int nRow = 0; nRow < nSize; nRow++)
+    {
+      for(int nCol = 0; nCol < nSize; nCol++)
+	nCrossSum += pImage[nCol] * pTemplate[nCol];
+      pImage += nRowStride;
+      pTemplate += nSize;
+    }
+  return nCrossSum;
+}
+
+// The inverse composition JT*d sum over the inner (N-2)x(N-2) template pixels; pImage is the
+// target pixel top-left of the first of them, afMix the bilinear mixing fractions TL, TR, BL, BR.
+template<int N>
+static inline Vector<3> SubPixAccum(const byte *pImage, long int nRowStride, const byte *pTemplate,
+				    const pair<float,float> *pJacs, int nRuntimeSize, const float afMix[4], double dMeanDiff)
+{
+  const int nSize = N ? N : nRuntimeSize;
+  Vector<3> v3Accum = Zeros;
+  for(int nRow = 1; nRow < nSize - 1; nRow++)
+    {
+      const byte *pTopLeftPixel = pImage + (nRow - 1) * nRowStride;
+      const byte *pTemplatePixel = pTemplate + nRow * nSize + 1;
+      const pair<float,float> *pJac = pJacs + (nRow - 1) * (nSize - 2);
+      for(int nCol = 0; nCol < nSize - 2; nCol++)
+	{
+	  float fPixel =   // Calc target interpolated pixel
+	    afMix[0] * pTopLeftPixel[nCol]              + afMix[1] * pTopLeftPixel[nCol + 1] + 
+	    afMix[2] * pTopLeftPixel[nCol + nRowStride] + afMix[3] * pTopLeftPixel[nCol + nRowStride + 1];
+	  double dDiff = fPixel - pTemplatePixel[nCol] + dMeanDiff;
+	  v3Accum[0] += dDiff * pJac[nCol].first;
+	  v3Accum[1] += dDiff * pJac[nCol].second;
+	  v3Accum[2] += dDiff;  // Update JT*d
+	}
+    }
+  return v3Accum;
+}
+
 PatchFinder::PatchFinder(int nPatchSize)
-  : mimTemplate(ImageRef(nPatchSize,nPatchSize))
 {
+  ImagePool<byte>::Instance().Resize(mimTemplate, ImageRef(nPatchSize,nPatchSize));
   mnPatchSize = nPatchSize;
   mirCenter = ImageRef(nPatchSize/2, nPatchSize/2);
   int nMaxSSDPerPixel = 500; // Pretty arbitrary... could make a GVar out of this.
@@ -26,21 +105,39 @@ PatchFinder::PatchFinder(int nPatchSize)
   // Populate the speed-up caches with bogus values:
   mm2LastWarpMatrix = 9999.9 * Identity;
   mpLastTemplateMapPoint = NULL;
+  mnLastTemplateLevel = -1;
+  mbTemplateRebuilt = false;
+  mbTemplateCold = false;
 };
 
+PatchFinder::~PatchFinder()
+{
+  ImagePool<byte>::Instance().Release(mimTemplate);
+  ImagePool<pair<float,float> >::Instance().Release(mimJacs);
+}
+
 
 // Find the warping matrix and search level
 int PatchFinder::CalcSearchLevelAndWarpMatrix(MapPoint &p,
 					      SE3<> se3CFromW,
 					      Matrix<2> &m2CamDerivs)
+{
+  return CalcSearchLevelAndWarpMatrix(p.v3WorldPos, p.v3PixelRight_W, p.v3PixelDown_W, se3CFromW, m2CamDerivs);
+}
+
+int PatchFinder::CalcSearchLevelAndWarpMatrix(const Vector<3> &v3WorldPos,
+					      const Vector<3> &v3PixelRight_W,
+					      const Vector<3> &v3PixelDown_W,
+					      SE3<> se3CFromW,
+					      Matrix<2> &m2CamDerivs)
 {
   // Calc point pos in new view camera frame
   // Slightly dumb that we re-calculate this here when the tracker's already done this!
-  Vector<3> v3Cam = se3CFromW * p.v3WorldPos;
+  Vector<3> v3Cam = se3CFromW * v3WorldPos;
   double dOneOverCameraZ = 1.0 / v3Cam[2];
   // Project the source keyframe's one-pixel-right and one-pixel-down vectors into the current view
-  Vector<3> v3MotionRight = se3CFromW.get_rotation() * p.v3PixelRight_W;
-  Vector<3> v3MotionDown = se3CFromW.get_rotation() * p.v3PixelDown_W;
+  Vector<3> v3MotionRight = se3CFromW.get_rotation() * v3PixelRight_W;
+  Vector<3> v3MotionDown = se3CFromW.get_rotation() * v3PixelDown_W;
   // Calculate in-image derivatives of source image pixel motions:
   mm2WarpInverse.T()[0] = m2CamDerivs * (v3MotionRight.slice<0,2>() - v3Cam.slice<0,2>() * v3MotionRight[2] * dOneOverCameraZ) * dOneOverCameraZ;
   mm2WarpInverse.T()[1] = m2CamDerivs * (v3MotionDown.slice<0,2>() - v3Cam.slice<0,2>() * v3MotionDown[2] * dOneOverCameraZ) * dOneOverCameraZ;
@@ -78,7 +175,9 @@ void PatchFinder::MakeTemplateCoarse(MapPoint &p,
 };
 
 // This function generates the warped search template.
-void PatchFinder::MakeTemplateCoarseCont(MapPoint &p)
+// dRefreshLimit is how much the warping matrix may have changed before the template
+// made last time for the same point is no longer good enough.
+void PatchFinder::MakeTemplateCoarseCont(MapPoint &p, double dRefreshLimit, bool bMayDecompress)
 {
   // Get the warping matrix appropriate for use with CVD::transform...
   Matrix<2> m2 = M2Inverse(mm2WarpInverse) * LevelScale(mnSearchLevel); 
@@ -87,31 +186,46 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint &p)
   
   // Optimisation: Don't re-gen the coarse template if it's going to be substantially the 
   // same as was made last time. This saves time when the camera is not moving. For this, 
-  // check that (a) this patchfinder is still working on the same map point and (b) the 
-  // warping matrix has not changed much.
+  // check that (a) this patchfinder is still working on the same map point and search level
+  // and (b) the warping matrix has not changed much. The default limit of 0.07 sort of works
+  // out as half a pixel displacement in src img.
   
   bool bNeedToRefreshTemplate = false;
-  if(&p != mpLastTemplateMapPoint)
+  if(&p != mpLastTemplateMapPoint || mnSearchLevel != mnLastTemplateLevel)
     bNeedToRefreshTemplate = true;
   // Still the same map point? Then compare warping matrix..
   for(int i=0; !bNeedToRefreshTemplate && i<2; i++)
     {
       Vector<2> v2Diff = m2.T()[i] - mm2LastWarpMatrix.T()[i];
-      const double dRefreshLimit = 0.07;  // Sort of works out as half a pixel displacement in src img
       if(v2Diff * v2Diff > dRefreshLimit * dRefreshLimit)
 	bNeedToRefreshTemplate = true;
     }
   
   // Need to regen template? Then go ahead.
+  mbTemplateRebuilt = bNeedToRefreshTemplate;
+  mbTemplateCold = false;
   if(bNeedToRefreshTemplate)
     {
       int nOutside;  // Use CVD::transform to warp the patch according the the warping matrix m2
                      // This returns the number of pixels outside the source image hit, which should be zero.
+      // The source keyframe may be in cold storage. The tracker mustn't decompress it, so
+      // then there's no template this time round.
+      if(bMayDecompress)
+	p.pPatchSourceKF->LockImages();
+      else if(!p.pPatchSourceKF->TryLockImages())
+	{
+	  mbTemplateRebuilt = false;
+	  mbTemplateBad = true;
+	  mbTemplateCold = true;
+	  mpLastTemplateMapPoint = NULL;
+	  return;
+	}
       nOutside = CVD::transform(p.pPatchSourceKF->aLevels[p.nSourceLevel].im, 
 				mimTemplate, 
 				m2,
 				vec(p.irCenter),
 				vec(mirCenter)); 
+      p.pPatchSourceKF->UnlockImages();
       
       if(nOutside)
 	mbTemplateBad = true;
@@ -124,6 +238,7 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint &p)
       // the patch next time round.
       mpLastTemplateMapPoint = &p;
       mm2LastWarpMatrix = m2;
+      mnLastTemplateLevel = mnSearchLevel;
     }
 };
 
@@ -133,9 +248,11 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint &p)
 void PatchFinder::MakeTemplateCoarseNoWarp(KeyFrame &k, int nLevel, ImageRef irLevelPos)
 {
   mnSearchLevel = nLevel;
+  k.LockImages();
   Image<byte> &im = k.aLevels[nLevel].im;
   if(!im.in_image_with_border(irLevelPos, mnPatchSize / 2 + 1))
     {
+      k.UnlockImages();
       mbTemplateBad = true;
       return;
     }
@@ -144,6 +261,7 @@ void PatchFinder::MakeTemplateCoarseNoWarp(KeyFrame &k, int nLevel, ImageRef irL
        mimTemplate,
        mimTemplate.size(),
        irLevelPos - mirCenter);
+  k.UnlockImages();
   
   MakeTemplateSums();
 }
@@ -205,36 +323,53 @@ bool PatchFinder::FindPatchCoarse(ImageRef irPos, KeyFrame &kf, unsigned int nRa
   
   // The next section finds all the FAST corners in the target level which 
   // are near enough the search center. It's a bit optimised to use 
-  // a corner row look-up-table, since otherwise the routine
+  // the level's corner bucket grid, since otherwise the routine
   // would spend a long time trawling throught the whole list of FAST corners!
-  vector<ImageRef>::iterator i;
-  vector<ImageRef>::iterator i_end;
-  
-  i = L.vCorners.begin() + L.vCornerRowLUT[nTop];
-  
-  if(nBottomPlusOne >= L.im.size().y)
-    i_end = L.vCorners.end();
-  else 
-    i_end = L.vCorners.begin() + L.vCornerRowLUT[nBottomPlusOne];
+  // Only the cells overlapping the search box are looked at.
+  int nCellLeft = max(nLeft, 0) / CORNER_GRID_CELL_SIZE;
+  int nCellRight = min(nRight / CORNER_GRID_CELL_SIZE, L.nCornerGridWidth - 1);
+  int nCellTop = nTop / CORNER_GRID_CELL_SIZE;
+  int nCellBottom = min((nBottomPlusOne - 1) / CORNER_GRID_CELL_SIZE, L.nCornerGridHeight - 1);
   
   ImageRef irBest;             // Best match so far
   int nBestSSD = mnMaxSSD + 1; // Best score so far is beyond the max allowed
+  int nBestIndex = -1;         // Index of the best match in L.vCorners
+  mvirCandidates.clear();
+  mvnCandidateIndices.clear();
   
-  for(; i<i_end; i++)          // For each corner ...
-    {                         
-      if( i->x < nLeft || i->x > nRight)
-        continue;
-      if((irPos - *i).mag_squared() > nRange * nRange)
-	continue;              // ... reject all those not close enough..
-
-      int nSSD;                // .. and find the ZMSSD at those near enough.
-      nSSD = ZMSSDAtPoint(L.im, *i);
-      if(nSSD < nBestSSD)      // Best yet?
+  for(int nCellY = nCellTop; nCellY <= nCellBottom; nCellY++)
+    for(int nCellX = nCellLeft; nCellX <= nCellRight; nCellX++)
+      {
+	int nCell = nCellY * L.nCornerGridWidth + nCellX;
+	for(int k = L.vCornerGridStart[nCell]; k < L.vCornerGridStart[nCell + 1]; k++)  // For each corner ...
+	  {
+	    int nIndex = L.vCornerGridIndex[k];
+	    const ImageRef &irCorner = L.vCorners[nIndex];
+	    if( irCorner.x < nLeft || irCorner.x > nRight)
+	      continue;
+	    if((irPos - irCorner).mag_squared() > nRange * nRange)
+	      continue;              // ... reject all those not close enough..
+	    
+	    mvirCandidates.push_back(irCorner);  // .. and collect those near enough.
+	    mvnCandidateIndices.push_back(nIndex);
+	  }
+      } // done looping over corners
+  
+  // Find the ZMSSD at all of them in one go..
+  ZMSSDAtPoints(L, mvirCandidates, mvnCandidateScores);
+  for(unsigned int i=0; i<mvirCandidates.size(); i++)
+    {
+      int nSSD = mvnCandidateScores[i];
+      int nIndex = mvnCandidateIndices[i];
+      // Best yet? Of equal scores, the corner first in vCorners wins, as it did
+      // when the corners were scanned in row order.
+      if(nSSD < nBestSSD || (nSSD == nBestSSD && nIndex < nBestIndex))
 	{
-	  irBest = *i;
+	  irBest = mvirCandidates[i];
 	  nBestSSD = nSSD;
+	  nBestIndex = nIndex;
 	}
-    } // done looping over corners
+    }
   
   if(nBestSSD < mnMaxSSD)      // Found a valid match?
     {
@@ -253,7 +388,7 @@ bool PatchFinder::FindPatchCoarse(ImageRef irPos, KeyFrame &kf, unsigned int nRa
 // (always unity, for each pixel) is not stored.
 void PatchFinder::MakeSubPixTemplate()
 {
-  mimJacs.resize(mimTemplate.size() - ImageRef(2,2));
+  ImagePool<pair<float,float> >::Instance().Resize(mimJacs, mimTemplate.size() - ImageRef(2,2));
   Matrix<3> m3H = Zeros; // This stores jTj.
   ImageRef ir;
   for(ir.x = 1; ir.x < mnPatchSize - 1; ir.x++)
@@ -268,13 +403,20 @@ void PatchFinder::MakeSubPixTemplate()
 	m3H += v3Grad.as_col() * v3Grad.as_row(); // Populate JTJ.
       }
   
-  // Invert JTJ..
-  Cholesky<3> chol(m3H);
-  mm3HInv = chol.get_inverse();
-  // TOON2 Does not have a get_rank for cholesky
-  // int nRank = chol.get_rank();
-  // if(nRank < 3)
-  // cout << "BAD RANK IN MAKESUBPIXELTEMPLATE!!!!" << endl; // This does not happen often (almost never!)
+  // Invert JTJ.. it's symmetric 3x3, so this is done in closed form.
+  mm3HInv = M3SymInverse(m3H);
+  
+  if(mnPatchSize == 8)  // Float copies for the SSE IterateSubPix
+    for(int nRow = 0; nRow < 6; nRow++)
+      for(int nCol = 0; nCol < 8; nCol++)
+	{
+	  bool bInside = nCol < 6;
+	  int n = nRow * 8 + nCol;
+	  mafSubPixTemplate[n] = bInside ? mimTemplate[nRow + 1][nCol + 1] : 0.0f;
+	  mafSubPixJacX[n] = bInside ? mimJacs[nRow][nCol].first : 0.0f;
+	  mafSubPixJacY[n] = bInside ? mimJacs[nRow][nCol].second : 0.0f;
+	  mafSubPixMask[nCol] = bInside ? 1.0f : 0.0f;
+	}
   
   mv2SubPixPos = mv2CoarsePos; // Start the sub-pixel search at the result of the coarse search..
   mdMeanDiff = 0.0;
@@ -317,8 +459,6 @@ double PatchFinder::IterateSubPix(KeyFrame &kf)
   // I.C. JT*d accumulator
   Vector<3> v3Accum = Zeros;
   
-  ImageRef ir;
-  
   byte* pTopLeftPixel;
   
   // Each template pixel will be compared to an interpolated target pixel
@@ -333,20 +473,74 @@ double PatchFinder::IterateSubPix(KeyFrame &kf)
   
   // Loop over template image
   unsigned long nRowOffset = &kf.aLevels[mnSearchLevel].im[ImageRef(0,1)] - &kf.aLevels[mnSearchLevel].im[ImageRef(0,0)];
-  for(ir.y = 1; ir.y < mnPatchSize - 1; ir.y++)
+#if CVD_HAVE_XMMINTRIN
+  if(mnPatchSize == 8)
     {
-      pTopLeftPixel = &im[::ir(v2Base) + ImageRef(1,ir.y)]; // n.b. the x=1 offset, as with y
-      for(ir.x = 1; ir.x < mnPatchSize - 1; ir.x++)
+      // The same in single precision, four pixels at a time: each 6-pixel template row is
+      // done as two halves of four, using the zero-padded float copies of the template and
+      // jacobians. The eight target bytes loaded per row stay inside the border checked above.
+      __m128 xMixTL = _mm_set1_ps(fMixTL);
+      __m128 xMixTR = _mm_set1_ps(fMixTR);
+      __m128 xMixBL = _mm_set1_ps(fMixBL);
+      __m128 xMixBR = _mm_set1_ps(fMixBR);
+      __m128 xMeanDiff = _mm_set1_ps((float) mdMeanDiff);
+      __m128i xZero = _mm_setzero_si128();
+      __m128 xAccumX = _mm_setzero_ps();
+      __m128 xAccumY = _mm_setzero_ps();
+      __m128 xAccumDiff = _mm_setzero_ps();
+      for(int nRow = 0; nRow < 6; nRow++)
 	{
-	  float fPixel =   // Calc target interpolated pixel
-	    fMixTL * pTopLeftPixel[0]          + fMixTR * pTopLeftPixel[1] + 
-	    fMixBL * pTopLeftPixel[nRowOffset] + fMixBR * pTopLeftPixel[nRowOffset + 1];
-	  pTopLeftPixel++;
-	  double dDiff = fPixel - mimTemplate[ir] + mdMeanDiff;
-	  v3Accum[0] += dDiff * mimJacs[ir - ImageRef(1,1)].first;
-	  v3Accum[1] += dDiff * mimJacs[ir - ImageRef(1,1)].second;
-	  v3Accum[2] += dDiff;  // Update JT*d
-	};
+	  pTopLeftPixel = &im[::ir(v2Base) + ImageRef(1,nRow + 1)];
+	  __m128i xTop = _mm_loadl_epi64((__m128i*) pTopLeftPixel);
+	  __m128i xBottom = _mm_loadl_epi64((__m128i*) (pTopLeftPixel + nRowOffset));
+	  __m128i xTLWords = _mm_unpacklo_epi8(xTop, xZero);
+	  __m128i xTRWords = _mm_unpacklo_epi8(_mm_srli_si128(xTop, 1), xZero);
+	  __m128i xBLWords = _mm_unpacklo_epi8(xBottom, xZero);
+	  __m128i xBRWords = _mm_unpacklo_epi8(_mm_srli_si128(xBottom, 1), xZero);
+	  for(int nHalf = 0; nHalf < 2; nHalf++)
+	    {
+	      __m128 xTL, xTR, xBL, xBR;
+	      if(nHalf == 0)
+		{
+		  xTL = _mm_cvtepi32_ps(_mm_unpacklo_epi16(xTLWords, xZero));
+		  xTR = _mm_cvtepi32_ps(_mm_unpacklo_epi16(xTRWords, xZero));
+		  xBL = _mm_cvtepi32_ps(_mm_unpacklo_epi16(xBLWords, xZero));
+		  xBR = _mm_cvtepi32_ps(_mm_unpacklo_epi16(xBRWords, xZero));
+		}
+	      else
+		{
+		  xTL = _mm_cvtepi32_ps(_mm_unpackhi_epi16(xTLWords, xZero));
+		  xTR = _mm_cvtepi32_ps(_mm_unpackhi_epi16(xTRWords, xZero));
+		  xBL = _mm_cvtepi32_ps(_mm_unpackhi_epi16(xBLWords, xZero));
+		  xBR = _mm_cvtepi32_ps(_mm_unpackhi_epi16(xBRWords, xZero));
+		}
+	      __m128 xPixel = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(xMixTL, xTL), _mm_mul_ps(xMixTR, xTR)),
+						    _mm_mul_ps(xMixBL, xBL)), _mm_mul_ps(xMixBR, xBR));
+	      int n = nRow * 8 + nHalf * 4;
+	      __m128 xDiff = _mm_add_ps(_mm_sub_ps(xPixel, _mm_loadu_ps(mafSubPixTemplate + n)), xMeanDiff);
+	      xAccumX = _mm_add_ps(_mm_mul_ps(xDiff, _mm_loadu_ps(mafSubPixJacX + n)), xAccumX);
+	      xAccumY = _mm_add_ps(_mm_mul_ps(xDiff, _mm_loadu_ps(mafSubPixJacY + n)), xAccumY);
+	      xAccumDiff = _mm_add_ps(_mm_mul_ps(xDiff, _mm_loadu_ps(mafSubPixMask + nHalf * 4)), xAccumDiff);
+	    }
+	}
+      float afSums[12];
+      _mm_storeu_ps(afSums, xAccumX);
+      _mm_storeu_ps(afSums + 4, xAccumY);
+      _mm_storeu_ps(afSums + 8, xAccumDiff);
+      for(int i=0; i<3; i++)
+	v3Accum[i] = (double) afSums[4*i] + afSums[4*i+1] + afSums[4*i+2] + afSums[4*i+3];
+    }
+  else
+#endif
+    {
+      float afMix[4] = {fMixTL, fMixTR, fMixBL, fMixBR};
+      pTopLeftPixel = &im[::ir(v2Base) + ImageRef(1,1)]; // n.b. the x=1 offset, as with y
+      if(mnPatchSize == 8)
+	v3Accum = SubPixAccum<8>(pTopLeftPixel, nRowOffset, &mimTemplate[ImageRef(0,0)],
+				 &mimJacs[ImageRef(0,0)], mnPatchSize, afMix, mdMeanDiff);
+      else
+	v3Accum = SubPixAccum<0>(pTopLeftPixel, nRowOffset, &mimTemplate[ImageRef(0,0)],
+				 &mimJacs[ImageRef(0,0)], mnPatchSize, afMix, mdMeanDiff);
     }
   
   // All done looping over image - find JTJ^-1 * JTd:
@@ -525,18 +719,13 @@ int PatchFinder::ZMSSDAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRe
   else
 #endif 
     {    
-      for(int nRow = 0; nRow < mnPatchSize; nRow++)
-	{
-	  imagepointer = &im[irImgBase + ImageRef(0,nRow)];
-	  templatepointer = &mimTemplate[ImageRef(0,nRow)];
-	  for(int nCol = 0; nCol < mnPatchSize; nCol++)
-	    {
-	      int n = imagepointer[nCol];
-	      nImageSum += n;
-	      nImageSumSq += n*n;
-	      nCrossSum += n * templatepointer[nCol];
-	    };
-	}
+      imagepointer = &im[irImgBase];
+      templatepointer = &mimTemplate[ImageRef(0,0)];
+      long int nRowStride = im[1] - im[0];
+      if(mnPatchSize == 8)
+	ZMSSDSums<8>(imagepointer, nRowStride, templatepointer, mnPatchSize, nImageSum, nImageSumSq, nCrossSum);
+      else
+	ZMSSDSums<0>(imagepointer, nRowStride, templatepointer, mnPatchSize, nImageSum, nImageSumSq, nCrossSum);
     };
   
   int SA = mnTemplateSum;
@@ -546,8 +735,165 @@ int PatchFinder::ZMSSDAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRe
   return ((2*SA*SB - SA*SA - SB*SB)/N + nImageSumSq + mnTemplateSumSq - 2*nCrossSum);
 }
 
+// Sum of the pixels of an nSize x nSize box, from an integral image.
+static inline int BoxSum(BasicImage<unsigned int> &imIntegral, const ImageRef &irTopLeft, int nSize)
+{
+  const unsigned int *pTop = imIntegral[irTopLeft.y] + irTopLeft.x;
+  const unsigned int *pBottom = imIntegral[irTopLeft.y + nSize] + irTopLeft.x;
+  return (int) (pBottom[nSize] - pBottom[0] - pTop[nSize] + pTop[0]);
+}
 
+// Only the cross term of the ZMSSD: the image-side sums come from integral images.
+int PatchFinder::CrossSumAtPoint(BasicImage<byte> &im, const ImageRef &irImgBase)
+{
+  int nCrossSum = 0;
+#if CVD_HAVE_XMMINTRIN
+  if(mnPatchSize == 8)
+    {
+      // Same as the cross sum part of the SSE ZMSSDAtPoint: the template is 16-byte
+      // aligned and eight bytes per row, so one load gives two template rows.
+      __m128i xZero = _mm_setzero_si128();
+      __m128i xCrossSums = _mm_setzero_si128();
+      byte *imagepointer = &im[irImgBase];
+      byte *templatepointer = &mimTemplate[ImageRef(0,0)];
+      long unsigned int imagepointerincrement = &im[irImgBase + ImageRef(0,1)] - imagepointer;
+      for(int nRow = 0; nRow < 8; nRow += 2)
+	{
+	  __m128i xTemplateAsEightBytes = _mm_load_si128((__m128i*) templatepointer);
+	  templatepointer += 16;
+	  __m128i xImageAsWords = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*) imagepointer), xZero);
+	  imagepointer += imagepointerincrement;
+	  xCrossSums = _mm_add_epi32(_mm_madd_epi16(xImageAsWords, _mm_unpacklo_epi8(xTemplateAsEightBytes, xZero)), xCrossSums);
+	  xImageAsWords = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*) imagepointer), xZero);
+	  imagepointer += imagepointerincrement;
+	  xCrossSums = _mm_add_epi32(_mm_madd_epi16(xImageAsWords, _mm_unpackhi_epi8(xTemplateAsEightBytes, xZero)), xCrossSums);
+	}
+      return SumXMM_32(xCrossSums);
+    }
+#endif
+  long int nRowStride = im[1] - im[0];
+  if(mnPatchSize == 8)
+    nCrossSum = CrossSum<8>(&im[irImgBase], nRowStride, &mimTemplate[ImageRef(0,0)], mnPatchSize);
+  else
+    nCrossSum = CrossSum<0>(&im[irImgBase], nRowStride, &mimTemplate[ImageRef(0,0)], mnPatchSize);
+  return nCrossSum;
+}
 
+// ZMSSDAtPoint for a pyramid level: gives exactly the same scores, but if the level
+// has integral images only the cross term needs the pixels.
+int PatchFinder::ZMSSDAtPoint(Level &L, const ImageRef &ir)
+{
+  if(!L.bIntegralsMade)
+    return ZMSSDAtPoint(L.im, ir);
+  if(!L.im.in_image_with_border(ir, mirCenter[0]))
+    return mnMaxSSD + 1;
+  
+  ImageRef irImgBase = ir - mirCenter;
+  int nImageSum = BoxSum(L.imSum, irImgBase, mnPatchSize);
+  int nImageSumSq = BoxSum(L.imSumSq, irImgBase, mnPatchSize);
+  int nCrossSum = CrossSumAtPoint(L.im, irImgBase);
+  
+  int SA = mnTemplateSum;
+  int SB = nImageSum;
+  
+  int N = mnPatchSize * mnPatchSize;
+  return ((2*SA*SB - SA*SA - SB*SB)/N + nImageSumSq + mnTemplateSumSq - 2*nCrossSum);
+}
 
+#if PATCHFINDER_HAVE_AVX2
+// Is the AVX2 coarse search usable on this CPU? Checked once, at start-up.
+static bool DetectAVX2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+static const bool gbHaveAVX2 = DetectAVX2();
 
+// The image-side sums and the cross sums of the 8x8 template at nPoints image locations,
+// given as pointers to their top-left pixels. The template stays in eight registers,
+// each holding one template row as words twice over, so that each 256-bit multiply-add
+// does a row of two locations at once. Results go in anSums as four ints per location:
+// the pixel sum, the sum of squares, and the cross sum twice.
+__attribute__((target("avx2")))
+static void ZMSSDSums8x8_AVX2(byte **ppBases, int nPoints, long int nRowStride, byte *pTemplate, int *anSums)
+{
+  __m256i ayTemplateRows[8];
+  for(int nRow = 0; nRow < 8; nRow++)
+    {
+      __m128i xRow = _mm_loadl_epi64((__m128i*) (pTemplate + 8 * nRow));
+      ayTemplateRows[nRow] = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(xRow, xRow));
+    }
+  __m256i yOnes = _mm256_set1_epi16(1);
+  
+  for(int i = 0; i < nPoints; i += 2)
+    {
+      byte *pA = ppBases[i];
+      byte *pB = ppBases[i + 1 < nPoints ? i + 1 : i];   // An odd one out is done twice
+      __m256i yImageSums = _mm256_setzero_si256();   // 16 x uint16
+      __m256i yImageSqSums = _mm256_setzero_si256(); // 8 x int32
+      __m256i yCrossSums = _mm256_setzero_si256();   // 8 x int32
+      for(int nRow = 0; nRow < 8; nRow++)
+	{
+	  __m128i xTwoRows = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*) (pA + nRow * nRowStride)),
+						_mm_loadl_epi64((__m128i*) (pB + nRow * nRowStride)));
+	  __m256i yImageAsWords = _mm256_cvtepu8_epi16(xTwoRows);
+	  yImageSums = _mm256_add_epi16(yImageAsWords, yImageSums);
+	  yImageSqSums = _mm256_add_epi32(_mm256_madd_epi16(yImageAsWords, yImageAsWords), yImageSqSums);
+	  yCrossSums = _mm256_add_epi32(_mm256_madd_epi16(yImageAsWords, ayTemplateRows[nRow]), yCrossSums);
+	}
+      // Horizontal sums within each 128-bit lane, i.e. per location: [sum, sumsq, cross, cross]
+      __m256i yHalf = _mm256_hadd_epi32(_mm256_madd_epi16(yImageSums, yOnes), yImageSqSums);
+      __m256i yCross = _mm256_hadd_epi32(yCrossSums, yCrossSums);
+      __m256i yAll = _mm256_hadd_epi32(yHalf, yCross);
+      if(i + 1 < nPoints)
+	_mm256_storeu_si256((__m256i*) (anSums + 4 * i), yAll);
+      else
+	_mm_storeu_si128((__m128i*) (anSums + 4 * i), _mm256_castsi256_si128(yAll));
+    }
+}
+#endif
 
+// Scores a whole batch of locations; vnScores[i] is the same as ZMSSDAtPoint(L, vir[i]) would give.
+// Fastest on a CPU with AVX2; otherwise this does the locations one by one.
+void PatchFinder::ZMSSDAtPoints(Level &L, const vector<ImageRef> &vir, vector<int> &vnScores)
+{
+  vnScores.resize(vir.size());
+#if PATCHFINDER_HAVE_AVX2
+  if(mnPatchSize == 8 && gbHaveAVX2 && vir.size() > 1)
+    {
+      // The locations too close to the border don't get a score; the rest go in the batch.
+      vector<byte*> &vpBases = mvpBatchBases;
+      vector<int> &vnBatch = mvnBatchMembers;
+      vector<int> &vnSums = mvnBatchSums;
+      vpBases.clear();
+      vnBatch.clear();
+      for(unsigned int i=0; i<vir.size(); i++)
+	if(L.im.in_image_with_border(vir[i], mirCenter[0]))
+	  {
+	    vpBases.push_back(&L.im[vir[i] - mirCenter]);
+	    vnBatch.push_back(i);
+	  }
+	else
+	  vnScores[i] = mnMaxSSD + 1;
+      if(vpBases.empty())
+	return;
+      
+      vnSums.resize(4 * vpBases.size());
+      long int nRowStride = L.im[1] - L.im[0];
+      ZMSSDSums8x8_AVX2(&vpBases[0], vpBases.size(), nRowStride, &mimTemplate[ImageRef(0,0)], &vnSums[0]);
+      
+      int SA = mnTemplateSum;
+      int N = mnPatchSize * mnPatchSize;
+      for(unsigned int j=0; j<vnBatch.size(); j++)
+	{
+	  int SB = vnSums[4 * j];
+	  int nImageSumSq = vnSums[4 * j + 1];
+	  int nCrossSum = vnSums[4 * j + 2];
+	  vnScores[vnBatch[j]] = ((2*SA*SB - SA*SA - SB*SB)/N + nImageSumSq + mnTemplateSumSq - 2*nCrossSum);
+	}
+      return;
+    }
+#endif
+  for(unsigned int i=0; i<vir.size(); i++)
+    vnScores[i] = ZMSSDAtPoint(L, vir[i]);
+}
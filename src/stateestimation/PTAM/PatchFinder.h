@@ -32,7 +32,8 @@
 //
 // Although PatchFinder can use arbitrary-sized search templates (it's determined
 // at construction), the use of 8x8 pixel templates (the default) is highly 
-// recommended, as the coarse search for this size is SSE-optimised.
+// recommended, as the coarse search for this size is SSE-optimised (and, on CPUs
+// which have it, uses AVX2 to score two search locations at once.)
 
 #ifndef __PATCHFINDER_H
 #define __PATCHFINDER_H
@@ -42,14 +43,18 @@ using namespace TooN;
 #include <TooN/se3.h>
 #include <cvd/image.h>
 #include <cvd/byte.h>
+#include <vector>
 #include "MapPoint.h"
 #include "LevelHelpers.h"
 
+struct Level;
+
 class PatchFinder
 {
 public:
   // Constructor defines size of search patch.
   PatchFinder(int nPatchSize = 8);
+  ~PatchFinder();
   
   // Step 1 Function.
   // This calculates the warping matrix appropriate for observing point p
@@ -59,13 +64,16 @@ public:
   // returned as an int. Negative level returned denotes an inappropriate 
   // transformation.
   int CalcSearchLevelAndWarpMatrix(MapPoint &p, SE3<> se3CFromW, Matrix<2> &m2CamDerivs);
+  // The same, for a point whose geometry comes from elsewhere (e.g. a MapSnapshot.)
+  int CalcSearchLevelAndWarpMatrix(const Vector<3> &v3WorldPos, const Vector<3> &v3PixelRight_W,
+				   const Vector<3> &v3PixelDown_W, SE3<> se3CFromW, Matrix<2> &m2CamDerivs);
   inline int GetLevel() { return mnSearchLevel; }
   inline int GetLevelScale() { return LevelScale(mnSearchLevel); }
   
   // Step 2 Functions
   // Generates the NxN search template either from the pre-calculated warping matrix,
   // or an identity transformation.
-  void MakeTemplateCoarseCont(MapPoint &p); // If the warping matrix has already been pre-calced, use this.
+  void MakeTemplateCoarseCont(MapPoint &p, double dRefreshLimit = 0.07, bool bMayDecompress = true); // If the warping matrix has already been pre-calced, use this.
   void MakeTemplateCoarse(MapPoint &p, SE3<> se3CFromW, Matrix<2> &m2CamDerivs); // This also calculates the warp.
   void MakeTemplateCoarseNoWarp(MapPoint &p);  // Identity warp: just copies pixels from the source KF.
   void MakeTemplateCoarseNoWarp(KeyFrame &k, int nLevel, CVD::ImageRef irLevelPos); // Identity warp if no MapPoint struct exists yet.
@@ -74,12 +82,26 @@ public:
   // this bool will return false.
   inline bool TemplateBad()      { return mbTemplateBad;} 
   
+  // Was the template bad because the source keyframe was in cold storage, and
+  // MakeTemplateCoarseCont wasn't allowed to decompress it?
+  inline bool TemplateCold()     { return mbTemplateCold;} 
+  
+  // Did the last MakeTemplateCoarseCont actually re-generate the template,
+  // or was the cached one still good enough?
+  inline bool TemplateRebuilt()  { return mbTemplateRebuilt;} 
+  
+  // Forget the cached template, so the next MakeTemplateCoarseCont re-generates it.
+  // Needed if a PatchFinder is re-used for a different map point.
+  inline void ForgetTemplate()   { mpLastTemplateMapPoint = NULL; }
+  
   // Step 3 Functions
   // This is the raison d'etre of the class: finds the patch in the current input view,
   // centered around ir, Searching around FAST corner locations only within a radius nRange only.
   // Inputs are given in level-zero coordinates! Returns true if the patch was found.
   bool FindPatchCoarse(CVD::ImageRef ir, KeyFrame &kf, unsigned int nRange);  
   int ZMSSDAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRef &ir); // This evaluates the score at one location
+  int ZMSSDAtPoint(Level &L, const CVD::ImageRef &ir);  // The same, using the level's integral images if it has them
+  void ZMSSDAtPoints(Level &L, const std::vector<CVD::ImageRef> &vir, std::vector<int> &vnScores); // Scores a batch of locations
   // Results from step 3:
   // All positions are in the scale of level 0.
   inline CVD::ImageRef GetCoarsePos() { return CVD::ImageRef((int) mv2CoarsePos[0], (int) mv2CoarsePos[1]);} 
@@ -111,6 +133,15 @@ protected:
   int mnTemplateSum;    // Cached pixel-sum of the coarse template
   int mnTemplateSumSq;  // Cached pixel-squared sum of the coarse template
   inline void MakeTemplateSums(); // Calculate above values
+  int CrossSumAtPoint(CVD::BasicImage<CVD::byte> &im, const CVD::ImageRef &irImgBase); // Sum of template x image pixels
+  
+  // Scratch space for FindPatchCoarse's batch of search locations, kept to avoid re-allocation:
+  std::vector<CVD::ImageRef> mvirCandidates;  // Corners near enough the search center
+  std::vector<int> mvnCandidateIndices;       // .. their indices in the level's vCorners
+  std::vector<int> mvnCandidateScores;        // .. and their ZMSSDs
+  std::vector<CVD::byte*> mvpBatchBases;      // ZMSSDAtPoints: top-left pixels of the locations not too near the border,
+  std::vector<int> mvnBatchMembers;           // .. which locations those are,
+  std::vector<int> mvnBatchSums;              // .. and the image and cross sums found there
   
   CVD::Image<CVD::byte> mimTemplate;   // The matching template
   CVD::Image<std::pair<float,float> > mimJacs;  // Inverse composition jacobians; stored as floats to save a bit of space.
@@ -118,6 +149,12 @@ protected:
   Matrix<2> mm2WarpInverse;   // Warping matrix
   int mnSearchLevel;          // Search level in input pyramid
   Matrix<3> mm3HInv;          // Inverse composition JtJ^-1
+  // For the SSE IterateSubPix of 8x8 patches: the inner 6x6 template pixels and jacobians as floats,
+  // in rows of eight of which the last two are zero, and a row mask which is one for the six real ones.
+  float mafSubPixTemplate[48];
+  float mafSubPixJacX[48];
+  float mafSubPixJacY[48];
+  float mafSubPixMask[8];
   Vector<2> mv2SubPixPos;     // In the scale of level 0
   double mdMeanDiff;          // Updated during inverse composition
   
@@ -126,10 +163,13 @@ protected:
   CVD::ImageRef mirCenter;    // Quantized location of the center pixel of the NxN pixel template
   bool mbFound;               // Was the patch found?
   bool mbTemplateBad;         // Error during template generation?
+  bool mbTemplateCold;        // .. because the source keyframe's images were compressed?
 
   // Some cached values to avoid duplicating work if the camera is stopped:
   MapPoint *mpLastTemplateMapPoint;  // Which was the last map point this PatchFinder used?
   Matrix<2> mm2LastWarpMatrix;       // What was the last warp matrix this PatchFinder used?
+  int mnLastTemplateLevel;           // .. and for which search level?
+  bool mbTemplateRebuilt;            // Was the template re-generated by the last MakeTemplateCoarseCont?
 };
 
 #endif
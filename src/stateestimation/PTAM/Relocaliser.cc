@@ -8,9 +8,8 @@ using namespace CVD;
 using namespace std;
 using namespace GVars3;
 
-Relocaliser::Relocaliser(Map &map, ATANCamera &camera)
-  : mMap(map),
-    mCamera(camera)
+Relocaliser::Relocaliser(ATANCamera &camera)
+  : mCamera(camera)
 {
 };
 
@@ -19,7 +18,7 @@ SE3<> Relocaliser::BestPose()
   return mse3Best;
 }
 
-bool Relocaliser::AttemptRecovery(KeyFrame &kCurrent)
+bool Relocaliser::AttemptRecovery(KeyFrame &kCurrent, const MapSnapshot &Snap)
 {
   // Ensure the incoming frame has a SmallBlurryImage attached
   if(!kCurrent.pSBI)
@@ -28,14 +27,14 @@ bool Relocaliser::AttemptRecovery(KeyFrame &kCurrent)
     kCurrent.pSBI->MakeFromKF(kCurrent);
   
   // Find the best ZMSSD match from all keyframes in map
-  ScoreKFs(kCurrent);
+  ScoreKFs(kCurrent, Snap);
 
   // And estimate a camera rotation from a 3DOF image alignment
-  pair<SE2<>, double> result_pair = kCurrent.pSBI->IteratePosRelToTarget(*mMap.vpKeyFrames[mnBest]->pSBI, 6);
+  pair<SE2<>, double> result_pair = kCurrent.pSBI->IteratePosRelToTarget(*Snap.vKeyFrames[mnBest].pKF->pSBI, 6);
   mse2 = result_pair.first;
   double dScore =result_pair.second;
   
-  SE3<> se3KeyFramePos = mMap.vpKeyFrames[mnBest]->se3CfromW;
+  SE3<> se3KeyFramePos = Snap.vKeyFrames[mnBest].se3CfromW;
   mse3Best = SmallBlurryImage::SE3fromSE2(mse2, mCamera) * se3KeyFramePos;
   
   if(dScore < GV2.GetDouble("Reloc2.MaxScore", 9e6, SILENT))
@@ -46,14 +45,14 @@ bool Relocaliser::AttemptRecovery(KeyFrame &kCurrent)
 
 // Compare current KF to all KFs stored in map by
 // Zero-mean SSD
-void Relocaliser::ScoreKFs(KeyFrame &kCurrent)
+void Relocaliser::ScoreKFs(KeyFrame &kCurrent, const MapSnapshot &Snap)
 {
   mdBestScore = 99999999999999.9;
   mnBest = -1;
   
-  for(unsigned int i=0; i<mMap.vpKeyFrames.size(); i++)
+  for(unsigned int i=0; i<Snap.vKeyFrames.size(); i++)
     {
-      double dSSD = kCurrent.pSBI->ZMSSD(*mMap.vpKeyFrames[i]->pSBI);
+      double dSSD = kCurrent.pSBI->ZMSSD(*Snap.vKeyFrames[i].pKF->pSBI);
       if(dSSD < mdBestScore)
 	{
 	  mdBestScore = dSSD;
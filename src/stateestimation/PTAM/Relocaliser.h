@@ -20,13 +20,12 @@
 class Relocaliser
 {
 public:
-  Relocaliser(Map &map, ATANCamera &camera);
-  bool AttemptRecovery(KeyFrame &k);
+  Relocaliser(ATANCamera &camera);
+  bool AttemptRecovery(KeyFrame &k, const MapSnapshot &Snap);  // Matches k against the keyframes of a map snapshot
   SE3<> BestPose();
   
 protected:
-  void ScoreKFs(KeyFrame &kCurrentF);
-  Map &mMap;
+  void ScoreKFs(KeyFrame &kCurrentF, const MapSnapshot &Snap);
   ATANCamera mCamera;
   int mnBest;
   double mdBestScore;
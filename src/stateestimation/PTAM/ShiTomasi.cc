@@ -1,8 +1,16 @@
 // Copyright 2008 Isis Innovation Limited
 #include "ShiTomasi.h"
+#include "ImagePool.h"
 #include <math.h>
 
+// Uses SSE2 intrinsics for the batched box sums.
+// If this causes problems, just do #define CVD_HAVE_XMMINTRIN 0
+#if CVD_HAVE_XMMINTRIN
+#include <emmintrin.h>
+#endif
+
 using namespace CVD;
+using namespace std;
 
 double FindShiTomasiScoreAtPoint(BasicImage<byte> &image,
 				 int nHalfBoxSize,
@@ -35,3 +43,121 @@ double FindShiTomasiScoreAtPoint(BasicImage<byte> &image,
   return 0.5 * (dXX + dYY - sqrt( (dXX + dYY) * (dXX + dYY) - 4 * (dXX * dYY - dXY * dXY) ));
 };
 
+
+// The smaller eigenvalue from the integer gradient sums over a box of
+// nPixels pixels. The sums are exact integers, so converting them to
+// double gives precisely what FindShiTomasiScoreAtPoint accumulates.
+static inline double ShiTomasiScoreFromSums(int nXX, int nYY, int nXY, int nPixels)
+{
+  double dXX = nXX / (2.0 * nPixels);
+  double dYY = nYY / (2.0 * nPixels);
+  double dXY = nXY / (2.0 * nPixels);
+  return 0.5 * (dXX + dYY - sqrt( (dXX + dYY) * (dXX + dYY) - 4 * (dXX * dYY - dXY * dXY) ));
+}
+
+void FindShiTomasiScores(BasicImage<byte> &image,
+			 int nHalfBoxSize,
+			 const vector<ImageRef> &vCenters,
+			 vector<double> &vdScores)
+{
+  vdScores.resize(vCenters.size());
+  if(vCenters.empty())
+    return;
+  
+  // Only the rows covered by the boxes need gradients.
+  int nTop = vCenters[0].y;
+  int nBottom = vCenters[0].y;
+  for(unsigned int i=1; i<vCenters.size(); i++)
+    {
+      if(vCenters[i].y < nTop) nTop = vCenters[i].y;
+      if(vCenters[i].y > nBottom) nBottom = vCenters[i].y;
+    }
+  nTop -= nHalfBoxSize;
+  nBottom += nHalfBoxSize;
+  
+  // Central-difference gradients of those rows; the outermost columns
+  // are never part of a box and are just zeroed. The gradient images come
+  // from the pool at the full image size, so that they fit the pool's size
+  // classes whatever the rows are; only the first nRows rows are used.
+  const int nWidth = image.size().x;
+  const int nRows = nBottom - nTop + 1;
+  Image<short> imDX;
+  Image<short> imDY;
+  ImagePool<short>::Instance().Resize(imDX, image.size());
+  ImagePool<short>::Instance().Resize(imDY, image.size());
+  for(int r=0; r<nRows; r++)
+    {
+      const byte *pRow = image[nTop + r];
+      const byte *pAbove = image[nTop + r - 1];
+      const byte *pBelow = image[nTop + r + 1];
+      short *pDX = imDX[r];
+      short *pDY = imDY[r];
+      pDX[0] = pDY[0] = 0;
+      pDX[nWidth-1] = pDY[nWidth-1] = 0;
+      for(int x=1; x<nWidth-1; x++)
+	{
+	  pDX[x] = pRow[x+1] - pRow[x-1];
+	  pDY[x] = pBelow[x] - pAbove[x];
+	}
+    }
+  
+  const int nBoxWidth = 2 * nHalfBoxSize + 1;
+  const int nPixels = nBoxWidth * nBoxWidth;
+  
+#if CVD_HAVE_XMMINTRIN
+  // Boxes up to eight pixels wide are summed one box row per pmaddwd,
+  // with the lanes beyond the box masked off. Each product is at most
+  // 2*255*255, so the 32-bit lanes cannot overflow for such boxes.
+  const bool bSSE = nBoxWidth <= 8;
+  const __m128i m128Mask = _mm_cmplt_epi16(_mm_set_epi16(7,6,5,4,3,2,1,0),
+					   _mm_set1_epi16(nBoxWidth));
+#endif
+  
+  for(unsigned int i=0; i<vCenters.size(); i++)
+    {
+      const int nLeft = vCenters[i].x - nHalfBoxSize;
+      const int nFirstRow = vCenters[i].y - nHalfBoxSize - nTop;
+      int nXX = 0;
+      int nYY = 0;
+      int nXY = 0;
+#if CVD_HAVE_XMMINTRIN
+      if(bSSE && nLeft + 8 <= nWidth)
+	{
+	  __m128i m128XX = _mm_setzero_si128();
+	  __m128i m128YY = _mm_setzero_si128();
+	  __m128i m128XY = _mm_setzero_si128();
+	  for(int r=nFirstRow; r<nFirstRow + nBoxWidth; r++)
+	    {
+	      __m128i m128DX = _mm_and_si128(_mm_loadu_si128((const __m128i*) (imDX[r] + nLeft)), m128Mask);
+	      __m128i m128DY = _mm_and_si128(_mm_loadu_si128((const __m128i*) (imDY[r] + nLeft)), m128Mask);
+	      m128XX = _mm_add_epi32(m128XX, _mm_madd_epi16(m128DX, m128DX));
+	      m128YY = _mm_add_epi32(m128YY, _mm_madd_epi16(m128DY, m128DY));
+	      m128XY = _mm_add_epi32(m128XY, _mm_madd_epi16(m128DX, m128DY));
+	    }
+	  int anXX[4], anYY[4], anXY[4];
+	  _mm_storeu_si128((__m128i*) anXX, m128XX);
+	  _mm_storeu_si128((__m128i*) anYY, m128YY);
+	  _mm_storeu_si128((__m128i*) anXY, m128XY);
+	  nXX = anXX[0] + anXX[1] + anXX[2] + anXX[3];
+	  nYY = anYY[0] + anYY[1] + anYY[2] + anYY[3];
+	  nXY = anXY[0] + anXY[1] + anXY[2] + anXY[3];
+	  vdScores[i] = ShiTomasiScoreFromSums(nXX, nYY, nXY, nPixels);
+	  continue;
+	}
+#endif
+      for(int r=nFirstRow; r<nFirstRow + nBoxWidth; r++)
+	{
+	  const short *pDX = imDX[r] + nLeft;
+	  const short *pDY = imDY[r] + nLeft;
+	  for(int x=0; x<nBoxWidth; x++)
+	    {
+	      nXX += pDX[x] * pDX[x];
+	      nYY += pDY[x] * pDY[x];
+	      nXY += pDX[x] * pDY[x];
+	    }
+	}
+      vdScores[i] = ShiTomasiScoreFromSums(nXX, nYY, nXY, nPixels);
+    }
+  ImagePool<short>::Instance().Release(imDX);
+  ImagePool<short>::Instance().Release(imDY);
+}
@@ -4,11 +4,22 @@
 
 #include <cvd/image.h>
 #include <cvd/byte.h>
+#include <vector>
 
 
 double FindShiTomasiScoreAtPoint(CVD::BasicImage<CVD::byte> &image,
 				 int nHalfBoxSize,
 				 CVD::ImageRef irCenter);
 
+// Scores a whole list of points of one image in one go: the image
+// gradients are calculated once for the rows spanned by the points,
+// and the box sums are done with SSE2 where available. Scores are
+// identical to calling FindShiTomasiScoreAtPoint for each point;
+// every point must be at least nHalfBoxSize+1 pixels from the border.
+void FindShiTomasiScores(CVD::BasicImage<CVD::byte> &image,
+			 int nHalfBoxSize,
+			 const std::vector<CVD::ImageRef> &vCenters,
+			 std::vector<double> &vdScores);
+
 
 #endif
@@ -1,17 +1,64 @@
 // Copyright 2008 Isis Innovation Limited
 #include "SmallBlurryImage.h"
+#include "ImagePool.h"
 #include <cvd/utility.h>
 #include <cvd/convolution.h>
 #include <cvd/vision.h>
 #include <TooN/se2.h>
 #include <TooN/Cholesky.h>
 #include <TooN/wls.h>
+// emmintrin.h contains the SSE2 intrinsics used for the mean subtraction.
+#if CVD_HAVE_XMMINTRIN
+#include <emmintrin.h>
+#endif
 
 using namespace CVD;
 using namespace std;
 
 ImageRef SmallBlurryImage::mirSize(-1,-1);
 
+// Fills imTemplate with imSmall minus its mean. Both images are
+// contiguous, so this runs over the raw pixel arrays. The SSE2 version
+// gives exactly the same result as the plain one: the byte sum is integer,
+// and the byte->float conversion before the subtraction is exact.
+static void SubtractMean(const BasicImage<byte> &imSmall, BasicImage<float> &imTemplate)
+{
+  const byte *pSmall = imSmall.data();
+  float *pTemplate = imTemplate.data();
+  const int nPixels = imSmall.size().area();
+  int i = 0;
+  unsigned int nSum = 0;
+  
+#if CVD_HAVE_XMMINTRIN
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = _mm_setzero_si128();
+  for(; i + 16 <= nPixels; i+=16)
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i*) (pSmall + i)), zero));
+  nSum = _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+#endif
+  for(; i < nPixels; i++)
+    nSum += pSmall[i];
+  
+  float fMean = ((float) nSum) / nPixels;
+  
+  i = 0;
+#if CVD_HAVE_XMMINTRIN
+  const __m128 mean = _mm_set1_ps(fMean);
+  for(; i + 16 <= nPixels; i+=16)
+    {
+      __m128i bytes = _mm_loadu_si128((const __m128i*) (pSmall + i));
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_ps(pTemplate + i,      _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), mean));
+      _mm_storeu_ps(pTemplate + i + 4,  _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), mean));
+      _mm_storeu_ps(pTemplate + i + 8,  _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), mean));
+      _mm_storeu_ps(pTemplate + i + 12, _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), mean));
+    }
+#endif
+  for(; i < nPixels; i++)
+    pTemplate[i] = pSmall[i] - fMean;
+}
+
 SmallBlurryImage::SmallBlurryImage(KeyFrame &kf, double dBlur)
 {
   mbMadeJacs = false;
@@ -23,33 +70,30 @@ SmallBlurryImage::SmallBlurryImage()
   mbMadeJacs = false;
 }
 
+SmallBlurryImage::~SmallBlurryImage()
+{
+  ImagePool<byte>::Instance().Release(mimSmall);
+  ImagePool<float>::Instance().Release(mimTemplate);
+  ImagePool<Vector<2> >::Instance().Release(mimImageJacs);
+}
+
 // Make a SmallBlurryImage from a KeyFrame This fills in the mimSmall
 // image (Which is just a small un-blurred version of the KF) and
 // mimTemplate (which is a floating-point, zero-mean blurred version
-// of the above)
+// of the above.) Can be called repeatedly on the same object: the
+// images are only re-allocated if their size changes.
 void SmallBlurryImage::MakeFromKF(KeyFrame &kf, double dBlur)
 {
   if(mirSize[0] == -1)
     mirSize = kf.aLevels[3].im.size() / 2;
   mbMadeJacs = false;
   
-  mimSmall.resize(mirSize);
-  mimTemplate.resize(mirSize);
+  ImagePool<byte>::Instance().Resize(mimSmall, mirSize);
+  ImagePool<float>::Instance().Resize(mimTemplate, mirSize);
   
   mbMadeJacs = false;
   halfSample(kf.aLevels[3].im, mimSmall);
-  ImageRef ir;
-  unsigned int nSum = 0;
-  do
-    nSum += mimSmall[ir];
-  while(ir.next(mirSize));
-  
-  float fMean = ((float) nSum) / mirSize.area();
-  
-  ir.home();
-  do
-    mimTemplate[ir] = mimSmall[ir] - fMean;
-  while(ir.next(mirSize));
+  SubtractMean(mimSmall, mimTemplate);
   
   convolveGaussian(mimTemplate, dBlur);
 }
@@ -58,7 +102,7 @@ void SmallBlurryImage::MakeFromKF(KeyFrame &kf, double dBlur)
 // of the blurred template
 void SmallBlurryImage::MakeJacs()
 {
-  mimImageJacs.resize(mirSize);
+  ImagePool<Vector<2> >::Instance().Resize(mimImageJacs, mirSize);
   // Fill in the gradient image
   ImageRef ir;
   do
@@ -113,7 +157,8 @@ pair<SE2<>,double> SmallBlurryImage::IteratePosRelToTarget(SmallBlurryImage &oth
   Vector<4> v4Accum;
   
   Vector<10> v10Triangle;
-  Image<float> imWarped(mirSize);
+  Image<float> imWarped;
+  ImagePool<float>::Instance().Resize(imWarped, mirSize);
 
   double dFinalScore = 0.0;
   for(int it = 0; it<nIterations; it++)
@@ -199,6 +244,7 @@ pair<SE2<>,double> SmallBlurryImage::IteratePosRelToTarget(SmallBlurryImage &oth
       dMeanOffset -= v4Update[3];
     }
 
+  ImagePool<float>::Instance().Release(imWarped);
   result_pair.first = se2CtoC;
   result_pair.second = dFinalScore;
   return result_pair;
@@ -18,6 +18,7 @@ class SmallBlurryImage
  public:
   SmallBlurryImage();
   SmallBlurryImage(KeyFrame &kf, double dBlur = 2.5);
+  ~SmallBlurryImage();
   void MakeFromKF(KeyFrame &kf, double dBlur = 2.5);
   void MakeJacs();
   double ZMSSD(SmallBlurryImage &other);
@@ -35,4 +35,27 @@ inline double M3Det(Matrix<3> m )
     m[0][2] * (m[1][0] * m[2][1]  - m[1][1] * m[2][0]);
 }
 
+// Inverse of a symmetric 3x3 (e.g. a JTJ), by the adjugate.
+// Only the upper triangle of m is looked at. A singular m gives infs/NaNs,
+// just as a Cholesky inverse would.
+inline Matrix<3> M3SymInverse(const Matrix<3> &m)
+{
+  double dA = m[1][1] * m[2][2] - m[1][2] * m[1][2];  // The cofactors..
+  double dB = m[0][2] * m[1][2] - m[0][1] * m[2][2];
+  double dC = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+  double dD = m[0][0] * m[2][2] - m[0][2] * m[0][2];
+  double dE = m[0][1] * m[0][2] - m[0][0] * m[1][2];
+  double dF = m[0][0] * m[1][1] - m[0][1] * m[0][1];
+  double dDet = m[0][0] * dA + m[0][1] * dB + m[0][2] * dC;
+  double dInverseDet = 1.0 / dDet;
+  Matrix<3> m3Res;
+  m3Res[0][0] = dA * dInverseDet;
+  m3Res[1][1] = dD * dInverseDet;
+  m3Res[2][2] = dF * dInverseDet;
+  m3Res[0][1] = m3Res[1][0] = dB * dInverseDet;
+  m3Res[0][2] = m3Res[2][0] = dC * dInverseDet;
+  m3Res[1][2] = m3Res[2][1] = dE * dInverseDet;
+  return m3Res;
+};
+
 #endif
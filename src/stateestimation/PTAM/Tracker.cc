@@ -30,7 +30,7 @@ Tracker::Tracker(ImageRef irVideoSize, const ATANCamera &c, Map &m, MapMaker &mm
   mMap(m),
   mMapMaker(mm),
   mCamera(c),
-  mRelocaliser(mMap, mCamera),
+  mRelocaliser(mCamera),
   mirSize(irVideoSize)
 {
   mCurrentKF.bFixed = false;
@@ -41,13 +41,30 @@ Tracker::Tracker(ImageRef irVideoSize, const ATANCamera &c, Map &m, MapMaker &mm
 
   mpSBILastFrame = NULL;
   mpSBIThisFrame = NULL;
+  mpTrackerData = new TrackerDataArena;
   mnLastKeyFrameDroppedClock = 0;
+  numCoarseIterations = numFineIterations = 0;
+  numTemplatesRebuilt = numTemplatesReused = 0;
+  mdLastPoseErrorSq = 0.0;
+  mbHavePredictedPoseSigmas = false;
+  mdPredictedTransSigma = mdPredictedRotSigma = 0.0;
+  mbHaveRotationPrior = mbUsedRotationPrior = false;
+  mnMapReader = mMap.RegisterReader();
+  mpMapSnapshot = &mMap.BeginRead(mnMapReader);
 
 
   // Most of the initialisation is done in Reset()
   Reset();
 }
 
+Tracker::~Tracker()
+{
+  mMap.EndRead(mnMapReader);
+  delete mpTrackerData;
+  delete mpSBILastFrame;
+  delete mpSBIThisFrame;
+}
+
 // Resets the tracker, wipes the map.
 // This is the main Reset-handler-entry-point of the program! Other classes' resets propagate from here.
 // It's always called in the Tracker's thread, often as a GUI command.
@@ -64,6 +81,7 @@ void Tracker::Reset()
   mlTrails.clear();
   mCamera.SetImageSize(mirSize);
   mCurrentKF.mMeasurements.clear();
+  mvCurrentMeasurements.clear();
   mnLastKeyFrameDropped = -20;
   mnLastKeyFrameDroppedClock = 0;
   mnFrame=0;
@@ -73,15 +91,24 @@ void Tracker::Reset()
 
   // Tell the MapMaker to reset itself.. 
   // this may take some time, since the mapmaker thread may have to wait
-  // for an abort-check during calculation, so sleep while waiting.
+  // for an abort-check during calculation, so block until it's done.
   // MapMaker will also clear the map.
+  // Our map snapshot would keep the old map alive, so let go of it first.
+  mMap.EndRead(mnMapReader);
   mMapMaker.RequestReset();
-  while(!mMapMaker.ResetDone())
-#ifndef WIN32
-	  usleep(10);
-#else
-	  Sleep(1);
-#endif
+  mMapMaker.WaitForResetDone();
+  mpMapSnapshot = &mMap.BeginRead(mnMapReader);
+
+  // The map is empty now: all points made from here on get fresh IDs.
+  mpTrackerData->Reset(MapPoint::nNextID);
+}
+
+// The tracker holds on to one map snapshot from the start of a frame until the start
+// of the next, so that what it hands out through GetMapSnapshot() stays valid in between.
+void Tracker::RefreshMapSnapshot()
+{
+  mMap.EndRead(mnMapReader);
+  mpMapSnapshot = &mMap.BeginRead(mnMapReader);
 }
 
 // TrackFrame is called by System.cc with each incoming video frame.
@@ -92,10 +119,12 @@ void Tracker::TrackFrame(Image<byte> &imFrame, bool bDraw)
 {
   mbDraw = bDraw;
   mMessageForUser.str("");   // Wipe the user message clean
+  RefreshMapSnapshot();      // Track against the map as the mapmaker last published it
   
   // Take the input video image, and convert it into the tracker's keyframe struct
   // This does things like generate the image pyramid and find FAST corners
   mCurrentKF.mMeasurements.clear();
+  mvCurrentMeasurements.clear();
   mCurrentKF.MakeKeyFrame_Lite(imFrame);
 
   // Update the small images for the rotation estimator
@@ -108,10 +137,9 @@ void Tracker::TrackFrame(Image<byte> &imFrame, bool bDraw)
       mpSBILastFrame = new SmallBlurryImage(mCurrentKF, *gvdSBIBlur);
     }
   else
-    {
-      delete  mpSBILastFrame;
-      mpSBILastFrame = mpSBIThisFrame;
-      mpSBIThisFrame = new SmallBlurryImage(mCurrentKF, *gvdSBIBlur);
+    { // The two SBIs are used as ping-pong buffers: this frame's one is rebuilt in place.
+      swap(mpSBILastFrame, mpSBIThisFrame);
+      mpSBIThisFrame->MakeFromKF(mCurrentKF, *gvdSBIBlur);
     }
   
   // From now on we only use the keyframe struct!
@@ -134,7 +162,8 @@ void Tracker::TrackFrame(Image<byte> &imFrame, bool bDraw)
   {
 	if(mnLostFrames < 3)  // .. but only if we're not lost!
 	{
-	  if(mbUseSBIInit)
+	  mbUsedRotationPrior = false;
+	  if(mbUseSBIInit && !UseRotationPrior())
 	    CalcSBIRotation();
 
 	  ApplyMotionModel();
@@ -158,7 +187,13 @@ void Tracker::TrackFrame(Image<byte> &imFrame, bool bDraw)
 	    mMessageForUser << " Found:";
 	    for(int i=0; i<LEVELS; i++) mMessageForUser << " " << manMeasFound[i] << "/" << manMeasAttempted[i];
 	    //	    mMessageForUser << " Found " << mnMeasFound << " of " << mnMeasAttempted <<". (";
-	    mMessageForUser << " Map: " << mMap.vpPoints.size() << "P, " << mMap.vpKeyFrames.size() << "KF";
+	    mMessageForUser << " Map: " << mpMapSnapshot->vPoints.size() << "P, " << mpMapSnapshot->vKeyFrames.size() << "KF";
+	    if(GV2.GetInt("Tracker.PoseEarlyStop", TRACKER_POSE_EARLY_STOP_DEFAULT, SILENT))
+	      mMessageForUser << " Its: " << numCoarseIterations << "/" << numFineIterations;
+	    if(GV2.GetInt("Tracker.ReportTemplateStats", TRACKER_REPORT_TEMPLATE_STATS_DEFAULT, SILENT))
+	      mMessageForUser << " Tmpl: " << numTemplatesRebuilt << "/" << numTemplatesRebuilt + numTemplatesReused;
+	    if(mbUseSBIInit && GV2.GetInt("Tracker.RotationPrior", TRACKER_ROTATION_PRIOR_DEFAULT, SILENT))
+	      mMessageForUser << " Rot: " << (mbUsedRotationPrior ? "IMU" : "SBI");
 	  }
 	  
 	  /*/ Heuristics to check if a key-frame should be added to the map:
@@ -187,6 +222,9 @@ void Tracker::TrackFrame(Image<byte> &imFrame, bool bDraw)
     TrackForInitialMap(); 
   }
   
+  // The rotation prior is only valid for this frame.
+  mbHaveRotationPrior = false;
+  
   // GUI interface
   while(!mvQueuedCommands.empty())
     {
@@ -225,7 +263,7 @@ void Tracker::TakeKF(bool force)
 	{
 	  // Heuristics to check if a key-frame should be added to the map:
 	  if(mTrackingQuality == GOOD && (force || (
-	     mMapMaker.NeedNewKeyFrame(mCurrentKF) &&
+	     mMapMaker.NeedNewKeyFrame(mCurrentKF, *mpMapSnapshot) &&
 	     ((double)(clock() - mnLastKeyFrameDroppedClock))/CLOCKS_PER_SEC > minKFTimeDist &&
 	     mMapMaker.QueueSize() < 3)))
 	    {
@@ -247,7 +285,7 @@ bool Tracker::AttemptRecovery()
 {
 	if(true)
 	{
-		  bool bRelocGood = mRelocaliser.AttemptRecovery(mCurrentKF);
+		  bool bRelocGood = mRelocaliser.AttemptRecovery(mCurrentKF, *mpMapSnapshot);
 		  if(!bRelocGood)
 			return false;
   
@@ -413,6 +451,7 @@ void Tracker::TrackForInitialMap()
 				vMatches.push_back(pair<ImageRef, ImageRef>(i->irInitialPos,
 							i->irCurrentPos));
 			bool succ = mMapMaker.InitFromStereo(mFirstKF, mCurrentKF, vMatches, mse3CamFromWorld, KFZeroDesiredCamFromWorld, predictedCFromW);  // This will take some time!
+			RefreshMapSnapshot();  // The rest of this frame should see the new map
 			if(succ)
 				lastStepResult = I_SECOND;
 			else
@@ -430,7 +469,7 @@ void Tracker::TrackForInitialMap()
 // The current frame is to be the first keyframe!
 void Tracker::TrailTracking_Start()
 {
-  mCurrentKF.MakeKeyFrame_Rest();  // This populates the Candidates list, which is Shi-Tomasi thresholded.
+  mCurrentKF.MakeKeyFrame_Rest(KeyFrameWorkerPool());  // This populates the Candidates list, which is Shi-Tomasi thresholded.
   mFirstKF = mCurrentKF; 
   vector<pair<double,ImageRef> > vCornersAndSTScores;
   for(unsigned int i=0; i<mCurrentKF.aLevels[0].vCandidates.size(); i++)  // Copy candidates into a trivially sortable vector
@@ -535,17 +574,24 @@ void Tracker::TrackMap()
     manMeasAttempted[i] = manMeasFound[i] = 0;
   
   // The Potentially-Visible-Set (PVS) is split into pyramid levels.
-  vector<TrackerData*> avPVS[LEVELS]; 
+  vector<TrackerData*> *avPVS = mavPVS; 
   for(int i=0; i<LEVELS; i++)
-    avPVS[i].reserve(500);
+    {
+      avPVS[i].clear();
+      avPVS[i].reserve(500);
+    }
+
+  // Optionally, search radii are chosen per point from the uncertainty of the pose prediction.
+  static gvar3<int> gvnAdaptiveSearch("Tracker.AdaptiveSearch", TRACKER_ADAPTIVE_SEARCH_DEFAULT, SILENT);
+  bool bAdaptiveSearch = *gvnAdaptiveSearch && mbHavePredictedPoseSigmas;
 
   // For all points in the map..
-  for(unsigned int i=0; i<mMap.vpPoints.size(); i++)
+  for(unsigned int i=0; i<mpMapSnapshot->vPoints.size(); i++)
     {
-      MapPoint &p= *(mMap.vpPoints[i]); 
-      // Ensure that this map point has an associated TrackerData struct.
-      if(!p.pTData) p.pTData = new TrackerData(&p);   
-      TrackerData &TData = *p.pTData;
+      const MapSnapshot::Point &sp = mpMapSnapshot->vPoints[i];
+      // Get this map point's TrackerData struct from the arena.
+      TrackerData &TData = mpTrackerData->Get(*sp.pPoint);
+      TData.pGeometry = &sp;
       
       // Project according to current view, and if it's not in the image, skip.
       TData.Project(mse3CamFromWorld, mCamera); 
@@ -556,10 +602,18 @@ void Tracker::TrackMap()
       TData.GetDerivsUnsafe(mCamera);
 
       // And check what the PatchFinder (included in TrackerData) makes of the mappoint in this view..
-      TData.nSearchLevel = TData.Finder.CalcSearchLevelAndWarpMatrix(TData.Point, mse3CamFromWorld, TData.m2CamDerivs);
+      TData.nSearchLevel = TData.Finder.CalcSearchLevelAndWarpMatrix(sp.v3WorldPos, sp.v3PixelRight_W, sp.v3PixelDown_W,
+								    mse3CamFromWorld, TData.m2CamDerivs);
       if(TData.nSearchLevel == -1)
 	continue;   // a negative search pyramid level indicates an inappropriate warp for this view, so skip.
 
+      // How far from its projection could the point be, given the uncertainty of the pose?
+      if(bAdaptiveSearch)
+	{
+	  TData.CalcJacobian();
+	  TData.CalcPixelSigma(mdPredictedTransSigma, mdPredictedRotSigma);
+	}
+
       // Otherwise, this point is suitable to be searched in the current image! Add to the PVS.
       TData.bSearched = false;
       TData.bFound = false;
@@ -573,8 +627,10 @@ void Tracker::TrackMap()
 
   // The next two data structs contain the list of points which will next 
   // be searched for in the image, and then used in pose update.
-  vector<TrackerData*> vNextToSearch;
-  vector<TrackerData*> vIterationSet;
+  vector<TrackerData*> &vNextToSearch = mvNextToSearch;
+  vector<TrackerData*> &vIterationSet = mvIterationSet;
+  vNextToSearch.clear();
+  vIterationSet.clear();
   
   // Tunable parameters to do with the coarse tracking stage:
   static gvar3<unsigned int> gvnCoarseMin("Tracker.CoarseMin", TRACKER_COARSE_MIN_DEFAULT, SILENT);   // Min number of large-scale features for coarse stage
@@ -587,6 +643,20 @@ void Tracker::TrackMap()
   unsigned int nCoarseMax = *gvnCoarseMax;
   unsigned int nCoarseRange = *gvnCoarseRange;
   
+  // Number of Gauss-Newton pose iterations per stage. Unless early stopping is enabled,
+  // always do the full ten iterations of the original PTAM.
+  static gvar3<int> gvnPoseEarlyStop("Tracker.PoseEarlyStop", TRACKER_POSE_EARLY_STOP_DEFAULT, SILENT);
+  static gvar3<int> gvnPoseMinIts("Tracker.PoseMinIterations", TRACKER_POSE_MIN_ITERATIONS_DEFAULT, SILENT);
+  static gvar3<int> gvnPoseMaxIts("Tracker.PoseMaxIterations", TRACKER_POSE_MAX_ITERATIONS_DEFAULT, SILENT);
+  bool bPoseEarlyStop = *gvnPoseEarlyStop != 0;
+  int nPoseMaxIts = 10;
+  if(bPoseEarlyStop)
+    nPoseMaxIts = max(1, *gvnPoseMaxIts);
+  int nPoseMinIts = min(nPoseMaxIts, *gvnPoseMinIts);
+  numCoarseIterations = numFineIterations = 0;
+  numTemplatesRebuilt = numTemplatesReused = 0;
+  mvpReusedTemplateKFs.clear();
+  
   mbDidCoarse = false;
 
   // Set of heuristics to check if we should do a coarse tracking stage.
@@ -641,12 +711,13 @@ void Tracker::TrackMap()
 	    }
 	}
       // Now go and attempt to find these points in the image!
-      unsigned int nFound = SearchForPoints(vNextToSearch, nCoarseRange, *gvnCoarseSubPixIts);
+      unsigned int nFound = SearchForPoints(vNextToSearch, nCoarseRange, *gvnCoarseSubPixIts, bAdaptiveSearch);
       vIterationSet = vNextToSearch;  // Copy over into the to-be-optimised list.
       if(nFound >= *gvnCoarseMin)  // Were enough found to do any meaningful optimisation?
 	{
 	  mbDidCoarse = true;
-	  for(int iter = 0; iter<10; iter++) // If so: do ten Gauss-Newton pose updates iterations.
+	  double dLastErrorSq = -1.0;
+	  for(int iter = 0; iter<nPoseMaxIts; iter++) // If so: do (up to) ten Gauss-Newton pose updates iterations.
 	    {
 	      if(iter != 0)
 		{ // Re-project the points on all but the first iteration.
@@ -667,6 +738,12 @@ void Tracker::TrackMap()
 	      Vector<6> v6Update = 
 		CalcPoseUpdate(vIterationSet, dOverrideSigma);
 	      mse3CamFromWorld = SE3<>::exp(v6Update) * mse3CamFromWorld;
+	      numCoarseIterations = iter + 1;
+	      
+	      // Stop early if converged.
+	      if(bPoseEarlyStop && iter + 1 >= nPoseMinIts && PoseUpdateConverged(v6Update, dLastErrorSq))
+		break;
+	      dLastErrorSq = mdLastPoseErrorSq;
 	    };
 	}
     };
@@ -684,7 +761,7 @@ void Tracker::TrackMap()
     int l = LEVELS - 1;
     for(unsigned int i=0; i<avPVS[l].size(); i++)
       avPVS[l][i]->ProjectAndDerivs(mse3CamFromWorld, mCamera);
-    SearchForPoints(avPVS[l], nFineRange, 8);
+    SearchForPoints(avPVS[l], nFineRange, 8, bAdaptiveSearch && !mbDidCoarse);
     for(unsigned int i=0; i<avPVS[l].size(); i++)
       vIterationSet.push_back(avPVS[l][i]);  // Again, plonk all searched points onto the (maybe already populate) vIterationSet.
   };
@@ -701,10 +778,16 @@ void Tracker::TrackMap()
   int nFinePatchesToUse = *gvnMaxPatchesPerFrame - vIterationSet.size();
   if(nFinePatchesToUse < 0)
     nFinePatchesToUse = 0;
+  static gvar3<int> gvnFineGridSelection("Tracker.FineGridSelection", TRACKER_FINE_GRID_SELECTION_DEFAULT, SILENT);
   if((int) vNextToSearch.size() > nFinePatchesToUse)
     {
-      random_shuffle(vNextToSearch.begin(), vNextToSearch.end());
-      vNextToSearch.resize(nFinePatchesToUse); // Chop!
+      if(*gvnFineGridSelection)
+	SelectPatchesOnGrid(vNextToSearch, nFinePatchesToUse);
+      else
+	{
+	  random_shuffle(vNextToSearch.begin(), vNextToSearch.end());
+	  vNextToSearch.resize(nFinePatchesToUse); // Chop!
+	}
     };
   
   // If we did a coarse tracking stage: re-project and find derivs of fine points
@@ -713,19 +796,26 @@ void Tracker::TrackMap()
       vNextToSearch[i]->ProjectAndDerivs(mse3CamFromWorld, mCamera);
   
   // Find fine points in image:
-  SearchForPoints(vNextToSearch, nFineRange, 0);
+  SearchForPoints(vNextToSearch, nFineRange, 0, bAdaptiveSearch && !mbDidCoarse);
   // And attach them all to the end of the optimisation-set.
   for(unsigned int i=0; i<vNextToSearch.size(); i++)
     vIterationSet.push_back(vNextToSearch[i]);
   
   // Again, ten gauss-newton pose update iterations.
+  // If early stopping is enabled, convergence makes the next iteration the last one,
+  // so that the final update is always nonlinear and still marks outliers.
   Vector<6> v6LastUpdate;
   v6LastUpdate = Zeros;
-  for(int iter = 0; iter<10; iter++)
+  double dLastErrorSq = -1.0;
+  bool bLastIteration = false;
+  for(int iter = 0; iter<nPoseMaxIts; iter++)
     {
+      if(iter == nPoseMaxIts - 1)
+	bLastIteration = true;
+      
       bool bNonLinearIteration; // For a bit of time-saving: don't do full nonlinear
                                 // reprojection at every iteration - it really isn't necessary!
-      if(iter == 0 || iter == 4 || iter == 9)
+      if(iter == 0 || iter == 4 || bLastIteration)
 	bNonLinearIteration = true;   // Even this is probably overkill, the reason we do many
       else                            // iterations is for M-Estimator convergence rather than 
 	bNonLinearIteration = false;  // linearisation effects.
@@ -758,9 +848,16 @@ void Tracker::TrackMap()
       
       // Calculate and update pose; also store update vector for linear iteration updates.
       Vector<6> v6Update = 
-	CalcPoseUpdate(vIterationSet, dOverrideSigma, iter==9);
+	CalcPoseUpdate(vIterationSet, dOverrideSigma, bLastIteration);
       mse3CamFromWorld = SE3<>::exp(v6Update) * mse3CamFromWorld;
       v6LastUpdate = v6Update;
+      numFineIterations = iter + 1;
+      
+      if(bLastIteration)
+	break;
+      if(bPoseEarlyStop && iter + 1 >= nPoseMinIts && PoseUpdateConverged(v6Update, dLastErrorSq))
+	bLastIteration = true;
+      dLastErrorSq = mdLastPoseErrorSq;
     };
   
   
@@ -826,13 +923,14 @@ void Tracker::TrackMap()
 
 
   // Update the current keyframe with info on what was found in the frame.
-  // Strictly speaking this is unnecessary to do every frame, it'll only be
-  // needed if the KF gets added to MapMaker. Do it anyway.
   // Export pose to current keyframe:
   mCurrentKF.se3CfromW = mse3CamFromWorld;
   
-  // Record successful measurements. Use the KeyFrame-Measurement struct for this.
+  // Record successful measurements. These go into a flat buffer, which is only
+  // turned into the KeyFrame's measurement map if the frame is added to the MapMaker
+  // (see AddNewKeyFrame) - most frames never are.
   mCurrentKF.mMeasurements.clear();
+  mvCurrentMeasurements.clear();
   for(vector<TrackerData*>::iterator it = vIterationSet.begin();
       it!= vIterationSet.end(); 
       it++)
@@ -843,7 +941,7 @@ void Tracker::TrackMap()
       m.v2RootPos = (*it)->v2Found;
       m.nLevel = (*it)->nSearchLevel;
       m.bSubPix = (*it)->bDidSubPix; 
-      mCurrentKF.mMeasurements[& ((*it)->Point)] = m;
+      mvCurrentMeasurements.push_back(make_pair((*it)->pPoint, m));
     }
   
   // Finally, find the mean scene depth from tracked features
@@ -867,19 +965,58 @@ void Tracker::TrackMap()
 	mCurrentKF.dSceneDepthSigma = sqrt((dSumSq / nNum) - (mCurrentKF.dSceneDepthMean) * (mCurrentKF.dSceneDepthMean));
       }
   }
+  
+  // A re-used template still counts as a use of its source keyframe's images, 
+  // else keyframes seen every frame would age into cold storage. Once per keyframe:
+  sort(mvpReusedTemplateKFs.begin(), mvpReusedTemplateKFs.end());
+  vector<KeyFrame*>::iterator itEnd = unique(mvpReusedTemplateKFs.begin(), mvpReusedTemplateKFs.end());
+  for(vector<KeyFrame*>::iterator it = mvpReusedTemplateKFs.begin(); it != itEnd; it++)
+    (*it)->TouchImages();
+}
+
+// Search radius for a single point: a multiple of the predicted std. deviation of its image
+// position, clamped to [Tracker.AdaptiveSearchMinRange, Tracker.AdaptiveSearchMaxScale * nRange].
+// So the search is narrow while the filter's prediction is confident, and wider than the
+// fixed range after fast manoeuvres.
+int Tracker::AdaptiveSearchRange(TrackerData &TD, int nRange)
+{
+  static gvar3<double> gvdSigmas("Tracker.AdaptiveSearchSigmas", TRACKER_ADAPTIVE_SEARCH_SIGMAS_DEFAULT, SILENT);
+  static gvar3<int> gvnMinRange("Tracker.AdaptiveSearchMinRange", TRACKER_ADAPTIVE_SEARCH_MIN_RANGE_DEFAULT, SILENT);
+  static gvar3<double> gvdMaxScale("Tracker.AdaptiveSearchMaxScale", TRACKER_ADAPTIVE_SEARCH_MAX_SCALE_DEFAULT, SILENT);
+  
+  int nMaxRange = max(*gvnMinRange, (int) (*gvdMaxScale * nRange));
+  double dRange = *gvdSigmas * TD.dPixelSigma;
+  if(!(dRange < nMaxRange))   // also catches NaNs
+    return nMaxRange;
+  return max(*gvnMinRange, (int) ceil(dRange));
 }
 
 // Find points in the image. Uses the PatchFiner struct stored in TrackerData
-int Tracker::SearchForPoints(vector<TrackerData*> &vTD, int nRange, int nSubPixIts)
+// If bAdaptiveRange is set, nRange is scaled per point by AdaptiveSearchRange.
+int Tracker::SearchForPoints(vector<TrackerData*> &vTD, int nRange, int nSubPixIts, bool bAdaptiveRange)
 {
+  // How much a point's warp may change before its template from the last frame is re-generated:
+  static gvar3<double> gvdWarpTolerance("Tracker.TemplateWarpTolerance", TRACKER_TEMPLATE_WARP_TOLERANCE_DEFAULT, SILENT);
   int nFound = 0;
+  bool bColdSources = false;
   for(unsigned int i=0; i<vTD.size(); i++)   // for each point..
     {
       // First, attempt a search at pixel locations which are FAST corners.
       // (PatchFinder::FindPatchCoarse)
       TrackerData &TD = *vTD[i];
       PatchFinder &Finder = TD.Finder;
-      Finder.MakeTemplateCoarseCont(TD.Point);
+      // Points whose source keyframe is in cold storage are skipped until the mapmaker has decompressed it.
+      Finder.MakeTemplateCoarseCont(*TD.pPoint, *gvdWarpTolerance, false);
+      if(Finder.TemplateCold())
+	bColdSources = true;
+      else if(Finder.TemplateRebuilt())
+	numTemplatesRebuilt++;
+      else
+	{
+	  numTemplatesReused++;
+	  if(TD.pPoint->pPatchSourceKF != NULL)
+	    mvpReusedTemplateKFs.push_back(TD.pPoint->pPatchSourceKF);
+	}
       if(Finder.TemplateBad())
 	{
 	  TD.bInImage = TD.bPotentiallyVisible = TD.bFound = false;
@@ -887,9 +1024,13 @@ int Tracker::SearchForPoints(vector<TrackerData*> &vTD, int nRange, int nSubPixI
 	}
       manMeasAttempted[Finder.GetLevel()]++;  // Stats for tracking quality assessmenta
       
+      int nPointRange = nRange;
+      if(bAdaptiveRange)
+	nPointRange = AdaptiveSearchRange(TD, nRange);
       bool bFound = 
-	Finder.FindPatchCoarse(ir(TD.v2Image), mCurrentKF, nRange);
+	Finder.FindPatchCoarse(ir(TD.v2Image), mCurrentKF, nPointRange);
       TD.bSearched = true;
+      TD.nSearchCount++;
       if(!bFound) 
 	{
 	  TD.bFound = false;
@@ -922,10 +1063,77 @@ int Tracker::SearchForPoints(vector<TrackerData*> &vTD, int nRange, int nSubPixI
 	  TD.v2Found = Finder.GetCoarsePosAsVector();
 	  TD.bDidSubPix = false;
 	}
+      TD.nFoundCount++;
     }
+  if(bColdSources)
+    mMapMaker.RequestDecompression();
   return nFound;
 };
 
+// Priority of a point in SelectPatchesOnGrid: coarser levels are worth more
+// (larger basin of convergence, fewer of them), and points which were found
+// often when searched for before are preferred over unreliable ones.
+static inline double GridSelectionScore(const TrackerData *pTD)
+{
+  double dSuccess = (pTD->nFoundCount + 1.0) / (pTD->nSearchCount + 2.0);
+  return dSuccess * (1 + pTD->nSearchLevel);
+}
+
+static bool GridSelectionBetter(const TrackerData *a, const TrackerData *b)
+{
+  double da = GridSelectionScore(a);
+  double db = GridSelectionScore(b);
+  if(da != db)
+    return da > db;
+  return a->pPoint->nID < b->pPoint->nID;  // Tie-break, so the selection is deterministic.
+}
+
+// Alternative to choosing the fine-stage patches at random: bucket the candidates
+// into a grid of Tracker.FineGridCellSize pixel cells, then go round the cells,
+// taking each cell's best remaining point per round. So the patch budget is spread
+// evenly over the image instead of clustering in highly-textured areas.
+void Tracker::SelectPatchesOnGrid(vector<TrackerData*> &vTD, unsigned int nMax)
+{
+  static gvar3<int> gvnCellSize("Tracker.FineGridCellSize", TRACKER_FINE_GRID_CELL_SIZE_DEFAULT, SILENT);
+  int nCellSize = max(1, *gvnCellSize);
+  int nCellsX = (mirSize.x + nCellSize) / nCellSize;
+  int nCellsY = (mirSize.y + nCellSize) / nCellSize;
+  
+  mvvGridCells.resize(nCellsX * nCellsY);
+  for(unsigned int i=0; i<mvvGridCells.size(); i++)
+    mvvGridCells[i].clear();
+  
+  for(unsigned int i=0; i<vTD.size(); i++)
+    {
+      int x = min(nCellsX - 1, max(0, (int) (vTD[i]->v2Image[0] / nCellSize)));
+      int y = min(nCellsY - 1, max(0, (int) (vTD[i]->v2Image[1] / nCellSize)));
+      mvvGridCells[y * nCellsX + x].push_back(vTD[i]);
+    }
+  
+  unsigned int nMaxInCell = 0;
+  for(unsigned int i=0; i<mvvGridCells.size(); i++)
+    {
+      sort(mvvGridCells[i].begin(), mvvGridCells[i].end(), GridSelectionBetter);
+      nMaxInCell = max(nMaxInCell, (unsigned int) mvvGridCells[i].size());
+    }
+  
+  vTD.clear();
+  for(unsigned int nRound = 0; nRound < nMaxInCell && vTD.size() < nMax; nRound++)
+    {
+      unsigned int nRoundStart = vTD.size();
+      for(unsigned int i=0; i<mvvGridCells.size(); i++)
+	if(nRound < mvvGridCells[i].size())
+	  vTD.push_back(mvvGridCells[i][nRound]);
+      
+      // Last round doesn't fit completely? Then take the best of it.
+      if(vTD.size() > nMax)
+	{
+	  sort(vTD.begin() + nRoundStart, vTD.end(), GridSelectionBetter);
+	  vTD.resize(nMax);
+	}
+    }
+}
+
 //Calculate a pose update 6-vector from a bunch of image measurements.
 //User-selectable M-Estimator.
 //Normally this robustly estimates a sigma-squared for all the measurements
@@ -933,7 +1141,7 @@ int Tracker::SearchForPoints(vector<TrackerData*> &vTD, int nRange, int nSubPixI
 //dOverrideSigma is positive. Also, bMarkOutliers set to true
 //records any instances of a point being marked an outlier measurement
 //by the Tukey MEstimator.
-Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> vTD, double dOverrideSigma, bool bMarkOutliers)
+Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> &vTD, double dOverrideSigma, bool bMarkOutliers)
 {
   // Which M-estimator are we using?
   int nEstimator = 0;
@@ -953,7 +1161,8 @@ Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> vTD, double dOverrideSigm
   
   // Find the covariance-scaled reprojection error for each measurement.
   // Also, store the square of these quantities for M-Estimator sigma squared estimation.
-  vector<double> vdErrorSquared;
+  vector<double> &vdErrorSquared = mvdErrorSquared;
+  vdErrorSquared.clear();
   for(unsigned int f=0; f<vTD.size(); f++)
     {
       TrackerData &TD = *vTD[f];
@@ -964,6 +1173,7 @@ Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> vTD, double dOverrideSigm
     };
   
   // No valid measurements? Return null update.
+  mdLastPoseErrorSq = 0.0;
   if(vdErrorSquared.size() == 0)
     return makeVector( 0,0,0,0,0,0);
   
@@ -985,6 +1195,8 @@ Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> vTD, double dOverrideSigm
   // It just needs errors and jacobians.
   WLS<6> wls;
   wls.add_prior(100.0); // Stabilising prior
+  double dSumWeightedErrorSq = 0.0; // Robust error accounting, used for the early-termination test.
+  double dSumWeight = 0.0;
   for(unsigned int f=0; f<vTD.size(); f++)
     {
       TrackerData &TD = *vTD[f];
@@ -1005,22 +1217,43 @@ Vector<6> Tracker::CalcPoseUpdate(vector<TrackerData*> vTD, double dOverrideSigm
       if(dWeight == 0.0)
 	{
 	  if(bMarkOutliers)
-	    TD.Point.nMEstimatorOutlierCount++;
+	    TD.pPoint->CountMEstimatorOutlier();
 	  continue;
 	}
       else
 	if(bMarkOutliers)
-	  TD.Point.nMEstimatorInlierCount++;
+	  TD.pPoint->CountMEstimatorInlier();
+      dSumWeightedErrorSq += dWeight * dErrorSq;
+      dSumWeight += dWeight;
       
       Matrix<2,6> &m26Jac = TD.m26Jacobian;
       wls.add_mJ(v2[0], (Vector<6>)(TD.dSqrtInvNoise * m26Jac[0]), dWeight); // These two lines are currently
       wls.add_mJ(v2[1], (Vector<6>)(TD.dSqrtInvNoise * m26Jac[1]), dWeight); // the slowest bit of poseits
     }
   
+  if(dSumWeight > 0)
+    mdLastPoseErrorSq = dSumWeightedErrorSq / dSumWeight;
+  
   wls.compute();
   return wls.get_mu();
 }
 
+// Early termination test for the Gauss-Newton pose iterations in TrackMap.
+// Converged if the pose update is tiny, or if the (robustly weighted) mean 
+// reprojection error has barely changed since the previous iteration.
+// dLastErrorSq is the error seen by the previous CalcPoseUpdate (negative if none).
+bool Tracker::PoseUpdateConverged(Vector<6> &v6Update, double dLastErrorSq)
+{
+  static gvar3<double> gvdUpdateConvLimit("Tracker.PoseUpdateSquaredConvLimit", TRACKER_POSE_UPDATE_SQUARED_CONV_LIMIT, SILENT);
+  static gvar3<double> gvdErrorConvLimit("Tracker.PoseErrorDecreaseConvLimit", TRACKER_POSE_ERROR_DECREASE_CONV_LIMIT, SILENT);
+  
+  if(v6Update * v6Update < *gvdUpdateConvLimit)
+    return true;
+  if(dLastErrorSq > 0 && fabs(dLastErrorSq - mdLastPoseErrorSq) < *gvdErrorConvLimit * dLastErrorSq)
+    return true;
+  return false;
+}
+
 
 // Just add the current velocity to the current pose.
 // N.b. this doesn't actually use time in any way, i.e. it assumes
@@ -1031,6 +1264,14 @@ void Tracker::ApplyMotionModel()
 
   mse3StartPos = mse3CamFromWorld;
 	
+  // The adaptive search radii come from the uncertainty of the filter's prediction,
+  // so the search has to be centred on that, not on the motion model's.
+  static gvar3<int> gvnAdaptiveSearch("Tracker.AdaptiveSearch", TRACKER_ADAPTIVE_SEARCH_DEFAULT, SILENT);
+  if(*gvnAdaptiveSearch && mbHavePredictedPoseSigmas)
+    {
+      mse3CamFromWorld = predictedCFromW;
+      return;
+    }
   
   Vector<6> v6Velocity = mv6CameraVelocity;
   if(mbUseSBIInit)
@@ -1066,10 +1307,23 @@ void Tracker::UpdateMotionModel()
   mdMSDScaledVelocityMagnitude = sqrt((double)(v6*v6));
 }
 
+// Orders the tracker's flat measurement buffer by map point.
+static bool MeasurementPointLess(const pair<MapPoint*, Measurement> &a, const pair<MapPoint*, Measurement> &b)
+{
+  return a.first < b.first;
+}
+
 // Time to add a new keyframe? The MapMaker handles most of this.
 void Tracker::AddNewKeyFrame()
 {
-  mMapMaker.AddKeyFrame(mCurrentKF);
+  // Only now build the keyframe's measurement map from this frame's measurements.
+  // Sorted by point, so each insertion can use the end of the map as a hint.
+  sort(mvCurrentMeasurements.begin(), mvCurrentMeasurements.end(), MeasurementPointLess);
+  mCurrentKF.mMeasurements.clear();
+  for(unsigned int i=0; i<mvCurrentMeasurements.size(); i++)
+    mCurrentKF.mMeasurements.insert(mCurrentKF.mMeasurements.end(), mvCurrentMeasurements[i]);
+  
+  mMapMaker.AddKeyFrame(mCurrentKF);  // Hands over the pyramid; the next frame's MakeKeyFrame_Lite allocates a new one.
   mnLastKeyFrameDropped = mnFrame;
   mnLastKeyFrameDroppedClock = clock();
 }
@@ -1119,7 +1373,7 @@ void Tracker::AssessTrackingQuality()
     {
       // Further heuristics to see if it's actually bad, not just dodgy...
       // If the camera pose estimate has run miles away, it's probably bad.
-      if(mMapMaker.IsDistanceToNearestKeyFrameExcessive(mCurrentKF))
+      if(mMapMaker.IsDistanceToNearestKeyFrameExcessive(mCurrentKF, *mpMapSnapshot))
 	mTrackingQuality = BAD;
     }
   
@@ -1146,6 +1400,27 @@ void Tracker::CalcSBIRotation()
   mv6SBIRot = se3Adjust.ln();
 }
 
+// Alternative to CalcSBIRotation: take the inter-frame rotation from the IMU
+// (see setRotationPrior), which saves the SBI jacobians and alignment.
+// Returns false if the prior is disabled, missing, or implausibly large,
+// in which case the SBI alignment has to be done as usual.
+bool Tracker::UseRotationPrior()
+{
+  static gvar3<int> gvnRotationPrior("Tracker.RotationPrior", TRACKER_ROTATION_PRIOR_DEFAULT, SILENT);
+  static gvar3<double> gvdMaxAngle("Tracker.RotationPriorMaxAngle", TRACKER_ROTATION_PRIOR_MAX_ANGLE_DEFAULT, SILENT);
+  if(!*gvnRotationPrior || !mbHaveRotationPrior)
+    return false;
+  
+  Vector<3> v3Rot = mso3RotationPrior.ln();
+  if(!(v3Rot * v3Rot <= *gvdMaxAngle * *gvdMaxAngle))  // also catches NaNs
+    return false;
+  
+  mv6SBIRot = Zeros;
+  mv6SBIRot.slice<3,3>() = v3Rot;
+  mbUsedRotationPrior = true;
+  return true;
+}
+
 ImageRef TrackerData::irImageSize;  // Static member of TrackerData lives here
 
 
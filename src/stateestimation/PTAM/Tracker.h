@@ -33,6 +33,7 @@
 
 
 class TrackerData;
+class TrackerDataArena;
 struct Trail    // This struct is used for initial correspondences of the first stereo pair.
 {
   MiniPatch mPatch;
@@ -44,6 +45,7 @@ class Tracker
 {
 public:
   Tracker(CVD::ImageRef irVideoSize, const ATANCamera &c, Map &m, MapMaker &mm);
+  ~Tracker();
   
   // TrackFrame is the main working part of the tracker: call this every frame.
   void TrackFrame(CVD::Image<CVD::byte> &imFrame, bool bDraw); 
@@ -57,8 +59,15 @@ public:
   
   inline void pressSpacebar() {mbUserPressedSpacebar = true;}
   inline void resetMap() {Reset();}
+  
+  // The map as the tracker saw it for the current frame; valid until the next TrackFrame.
+  inline const MapSnapshot &GetMapSnapshot() {return *mpMapSnapshot;}
   int numPointsFound;
   int numPointsAttempted;
+  int numCoarseIterations;	// gauss-newton pose iterations actually done in the last TrackMap (coarse / fine stage)
+  int numFineIterations;
+  int numTemplatesRebuilt;	// search templates re-generated in the last TrackMap, out of numTemplatesRebuilt + numTemplatesReused..
+  int numTemplatesReused;	// .. those for which the previous frame's was still good enough
   enum {I_FIRST, I_SECOND, I_FAILED ,T_GOOD, T_DODGY, T_LOST, T_RECOVERED_GOOD, T_RECOVERED_DODGY, NOT_TRACKING, INITIALIZING, T_TOOK_KF} lastStepResult;
 
   // kf takking parameters (settable via ros dyn. reconfigure)
@@ -70,11 +79,25 @@ public:
   inline void setPredictedCamFromW(SE3<>& camFromW) {predictedCFromW = camFromW;}
   inline void setLastFrameLost(bool lost, bool useGuessForRecovery = false) {lastFrameLost = lost; useGuess = useGuessForRecovery;};
 
+  // std. deviations of the predicted camera pose (translation in map units, rotation in radians).
+  // if Tracker.AdaptiveSearch is set, they scale the per-point search radii, and the search
+  // starts from the predicted pose (setPredictedCamFromW) instead of the motion model's.
+  inline void setPredictedPoseSigmas(double transSigma, double rotSigma) {mdPredictedTransSigma = transSigma; mdPredictedRotSigma = rotSigma; mbHavePredictedPoseSigmas = true;}
+
+  // rotation of the camera since the last frame, as measured by the drone's IMU (camFromW_this * camFromW_last^-1).
+  // only valid for the next call of TrackFrame; used instead of the SBI alignment if Tracker.RotationPrior is set.
+  inline void setRotationPrior(const SO3<>& rotation) {mso3RotationPrior = rotation; mbHaveRotationPrior = true;}
+
 protected:
   KeyFrame mCurrentKF;            // The current working frame as a keyframe struct
+  std::vector<std::pair<MapPoint*, Measurement> > mvCurrentMeasurements; // Measurements made in the current frame. Only
+                                                                         // copied into mCurrentKF.mMeasurements if it becomes a keyframe.
   
   // The major components to which the tracker needs access:
   Map &mMap;                      // The map, consisting of points and keyframes
+  int mnMapReader;                // Our reader slot in the map
+  const MapSnapshot *mpMapSnapshot; // .. and the snapshot of it we're reading
+  void RefreshMapSnapshot();      // Lets go of the snapshot, and gets the latest one
   MapMaker &mMapMaker;            // The class which maintains the map
   ATANCamera mCamera;             // Projection model
   Relocaliser mRelocaliser;       // Relocalisation module
@@ -97,16 +120,23 @@ protected:
   SE3<> KFZeroDesiredCamFromWorld;	      // ADDED: this is the pose, KFZero is supposed to have, after stereo-init.
 
   // Methods for tracking the map once it has been made:
+  TrackerDataArena *mpTrackerData; // Per-point intermediate results, indexed by map point ID
   void TrackMap();                // Called by TrackFrame if there is a map.
   void AssessTrackingQuality();   // Heuristics to choose between good, poor, bad.
   void ApplyMotionModel();        // Decaying velocity motion model applied prior to TrackMap
   void UpdateMotionModel();       // Motion model is updated after TrackMap
   int SearchForPoints(std::vector<TrackerData*> &vTD, 
 		      int nRange, 
-		      int nFineIts);  // Finds points in the image
-  Vector<6> CalcPoseUpdate(std::vector<TrackerData*> vTD, 
+		      int nFineIts,
+		      bool bAdaptiveRange = false);  // Finds points in the image
+  int AdaptiveSearchRange(TrackerData &TD, int nRange);  // Per-point search radius from the predicted pose uncertainty
+  void SelectPatchesOnGrid(std::vector<TrackerData*> &vTD, 
+			   unsigned int nMax);           // Keeps nMax points, spread over the image
+  Vector<6> CalcPoseUpdate(std::vector<TrackerData*> &vTD, 
 			   double dOverrideSigma = 0.0, 
 			   bool bMarkOutliers = false); // Updates pose from found points.
+  bool PoseUpdateConverged(Vector<6> &v6Update, double dLastErrorSq); // Early-termination test for the pose iterations.
+  double mdLastPoseErrorSq;         // Mean squared cov-scaled reprojection error seen by the last CalcPoseUpdate.
   SE3<> mse3CamFromWorld;           // Camera pose: this is what the tracker updates every frame.
   SE3<> mse3StartPos;               // What the camera pose was at the start of the frame.
   Vector<6> mv6CameraVelocity;    // Motion model
@@ -114,6 +144,19 @@ protected:
   double mdMSDScaledVelocityMagnitude; // Velocity magnitude scaled by relative scene depth.
   bool mbDidCoarse;               // Did tracking use the coarse tracking stage?
   
+  bool mbHavePredictedPoseSigmas; // Uncertainty of the pose prediction, see setPredictedPoseSigmas()
+  double mdPredictedTransSigma;
+  double mdPredictedRotSigma;
+  
+  // Per-frame working buffers of TrackMap and CalcPoseUpdate. Members rather than locals,
+  // so their storage is re-used from frame to frame instead of being re-allocated.
+  std::vector<TrackerData*> mavPVS[LEVELS];
+  std::vector<TrackerData*> mvNextToSearch;
+  std::vector<TrackerData*> mvIterationSet;
+  std::vector<double> mvdErrorSquared;
+  std::vector<std::vector<TrackerData*> > mvvGridCells;
+  std::vector<KeyFrame*> mvpReusedTemplateKFs;   // Source keyframes of templates re-used without touching their images
+  
   bool mbDraw;                    // Should the tracker draw anything to OpenGL?
   
   // Interface with map maker:
@@ -143,6 +186,10 @@ protected:
   void CalcSBIRotation();
   Vector<6> mv6SBIRot;
   bool mbUseSBIInit;
+  bool UseRotationPrior();         // Fills mv6SBIRot from the IMU rotation prior instead, if there is a plausible one.
+  SO3<> mso3RotationPrior;
+  bool mbHaveRotationPrior;
+  bool mbUsedRotationPrior;
   
   // User interaction for initial tracking:
   bool mbUserPressedSpacebar;
@@ -5,6 +5,9 @@
 
 #include "PatchFinder.h"
 #include "ATANCamera.h"
+#include "Map.h"
+#include <vector>
+#include <cassert>
 
 // This class contains all the intermediate results associated with
 // a map-point that the tracker keeps up-to-date. TrackerData
@@ -12,14 +15,27 @@
 // and also contains the PatchFinder which does the image search.
 // It's very code-heavy for an h-file (it's a bunch of methods really)
 // but it's only included from Tracker.cc!
+// TrackerData structs are not allocated per map point, but live in the
+// tracker's TrackerDataArena (see below), and are bound to a point on first use.
 
 struct TrackerData
 {
-TrackerData(MapPoint *pMapPoint) 
-: Point(*pMapPoint)
+TrackerData() 
+: pPoint(NULL), pGeometry(NULL)
   {};
   
-  MapPoint &Point;
+  // (Re-)bind this struct to a map point.
+  inline void Bind(MapPoint *pMapPoint)
+  {
+    pPoint = pMapPoint;
+    pGeometry = NULL;
+    bInImage = bPotentiallyVisible = bSearched = bFound = false;
+    nSearchCount = nFoundCount = 0;
+    Finder.ForgetTemplate();
+  }
+  
+  MapPoint *pPoint;
+  const MapSnapshot::Point *pGeometry;  // The point's position etc, as of the tracker's current map snapshot
   PatchFinder Finder;
   
   // Projection itermediates:
@@ -37,18 +53,24 @@ TrackerData(MapPoint *pMapPoint)
   Vector<2> v2Found;      // Pixel coords of found patch (L0)
   double dSqrtInvNoise;   // Only depends on search level..
   
+  // Search history of this point, used to prefer reliable points:
+  int nSearchCount;
+  int nFoundCount;
+  
   
   // Stuff for pose update:
   Vector<2> v2Error_CovScaled;
   Matrix<2,6> m26Jacobian;   // Jacobian wrt camera position
   
+  double dPixelSigma;     // Predicted std. dev. of the point's L0 image position (for adaptive search)
+  
   // Project point into image given certain pose and camera.
   // This can bail out at several stages if the point
   // will not be properly in the image.
   inline void Project(const SE3<> &se3CFromW, ATANCamera &Cam)
   {
     bInImage = bPotentiallyVisible = false;
-    v3Cam = se3CFromW * Point.v3WorldPos;
+    v3Cam = se3CFromW * pGeometry->v3WorldPos;
     if(v3Cam[2] < 0.001)
       return;
     v2ImPlane = project(v3Cam);
@@ -96,6 +118,22 @@ TrackerData(MapPoint *pMapPoint)
       };
   }
   
+  // Propagate the uncertainty of the camera pose into the image: with isotropic
+  // translation and rotation std. deviations, the trace of J * Sigma * J^T is just the
+  // weighted sum of the squared Jacobian entries. Needs m26Jacobian.
+  inline void CalcPixelSigma(double dTransSigma, double dRotSigma)
+  {
+    double dTransVar = 0.0;
+    double dRotVar = 0.0;
+    for(int r=0; r<2; r++)
+      for(int m=0; m<3; m++)
+	{
+	  dTransVar += m26Jacobian[r][m] * m26Jacobian[r][m];
+	  dRotVar += m26Jacobian[r][m+3] * m26Jacobian[r][m+3];
+	}
+    dPixelSigma = sqrt(dTransVar * dTransSigma * dTransSigma + dRotVar * dRotSigma * dRotSigma);
+  }
+  
   // Sometimes in tracker instead of reprojecting, just update the error linearly!
   inline void LinearUpdate(const Vector<6> &v6)
   {
@@ -106,6 +144,51 @@ TrackerData(MapPoint *pMapPoint)
   static CVD::ImageRef irImageSize;
 };
 
+// The tracker's per-point scratch space. TrackerData structs are stored in blocks
+// of contiguous structs, and looked up by MapPoint::nID. Blocks are only ever
+// allocated when the map grows beyond all points seen so far, and are re-used after
+// a reset; they never move, so TrackerData pointers stay valid. Keeping this out of 
+// the MapPoints also means that the only MapPoint fields the tracker writes are the
+// M-estimator counts, which are atomic (see MapPoint.h.)
+class TrackerDataArena
+{
+public:
+  TrackerDataArena() : mnBaseID(0) {};
+  ~TrackerDataArena()
+  {
+    for(unsigned int i=0; i<mvpBlocks.size(); i++)
+      delete[] mvpBlocks[i];
+  }
+  
+  // Forget all points; IDs from nBaseID upwards will be stored from the start of the arena.
+  // Allocated blocks are kept for re-use.
+  inline void Reset(unsigned int nBaseID)
+  {
+    mnBaseID = nBaseID;
+    for(unsigned int i=0; i<mvpBlocks.size(); i++)
+      for(int j=0; j<BLOCK_SIZE; j++)
+	mvpBlocks[i][j].pPoint = NULL;
+  }
+  
+  // Get the TrackerData struct of a map point, binding it if this is the first use.
+  inline TrackerData &Get(MapPoint &p)
+  {
+    assert(p.nID >= mnBaseID);
+    unsigned int nIndex = p.nID - mnBaseID;
+    while((nIndex >> BLOCK_BITS) >= mvpBlocks.size())
+      mvpBlocks.push_back(new TrackerData[BLOCK_SIZE]);
+    TrackerData &TData = mvpBlocks[nIndex >> BLOCK_BITS][nIndex & (BLOCK_SIZE - 1)];
+    if(TData.pPoint != &p)
+      TData.Bind(&p);
+    return TData;
+  }
+  
+protected:
+  enum {BLOCK_BITS = 10, BLOCK_SIZE = 1 << BLOCK_BITS};
+  std::vector<TrackerData*> mvpBlocks;
+  unsigned int mnBaseID;
+};
+
 
 
 
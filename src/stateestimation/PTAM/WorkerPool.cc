@@ -0,0 +1,105 @@
+#include "WorkerPool.h"
+#include <algorithm>
+
+using namespace CVD;
+using namespace std;
+
+WorkerPool::WorkerPool(int nThreads)
+{
+  mbStop = false;
+  pthread_mutex_init(&mMutex, NULL);
+  pthread_cond_init(&mcondWork, NULL);
+  pthread_cond_init(&mcondDone, NULL);
+  
+  for(int i=0; i<nThreads; i++)
+    {
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, WorkerMain, this) != 0)
+	break;  // Couldn't start another thread: go on with those we have.
+      mvThreads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+  pthread_mutex_lock(&mMutex);
+  mbStop = true;
+  pthread_cond_broadcast(&mcondWork);
+  pthread_mutex_unlock(&mMutex);
+  
+  for(unsigned int i=0; i<mvThreads.size(); i++)
+    pthread_join(mvThreads[i], NULL);
+  
+  pthread_cond_destroy(&mcondDone);
+  pthread_cond_destroy(&mcondWork);
+  pthread_mutex_destroy(&mMutex);
+}
+
+// Hands out the next job of a batch. Whoever takes the last one
+// removes the batch from the queue.
+Runnable *WorkerPool::TakeJob(Batch *pBatch)
+{
+  Runnable *pJob = (*pBatch->pvpJobs)[pBatch->nNext++];
+  if(pBatch->nNext == pBatch->pvpJobs->size())
+    mqBatches.erase(find(mqBatches.begin(), mqBatches.end(), pBatch));
+  return pJob;
+}
+
+void WorkerPool::Run(vector<Runnable*> &vpJobs)
+{
+  if(vpJobs.empty())
+    return;
+  if(mvThreads.empty())
+    {
+      for(unsigned int i=0; i<vpJobs.size(); i++)
+	vpJobs[i]->run();
+      return;
+    }
+  
+  Batch batch;
+  batch.pvpJobs = &vpJobs;
+  batch.nNext = 0;
+  batch.nUnfinished = vpJobs.size();
+  
+  pthread_mutex_lock(&mMutex);
+  mqBatches.push_back(&batch);
+  pthread_cond_broadcast(&mcondWork);
+  
+  // Help out with our own batch..
+  while(batch.nNext < vpJobs.size())
+    {
+      Runnable *pJob = TakeJob(&batch);
+      pthread_mutex_unlock(&mMutex);
+      pJob->run();
+      pthread_mutex_lock(&mMutex);
+      batch.nUnfinished--;
+    }
+  
+  // .. then wait for the jobs which the workers are still running.
+  while(batch.nUnfinished > 0)
+    pthread_cond_wait(&mcondDone, &mMutex);
+  pthread_mutex_unlock(&mMutex);
+}
+
+void *WorkerPool::WorkerMain(void *pPool)
+{
+  WorkerPool &pool = *(WorkerPool*) pPool;
+  pthread_mutex_lock(&pool.mMutex);
+  while(true)
+    {
+      while(!pool.mbStop && pool.mqBatches.empty())
+	pthread_cond_wait(&pool.mcondWork, &pool.mMutex);
+      if(pool.mbStop)
+	break;
+      
+      Batch *pBatch = pool.mqBatches.front();
+      Runnable *pJob = pool.TakeJob(pBatch);
+      pthread_mutex_unlock(&pool.mMutex);
+      pJob->run();
+      pthread_mutex_lock(&pool.mMutex);
+      if(--pBatch->nUnfinished == 0)
+	pthread_cond_broadcast(&pool.mcondDone);
+    }
+  pthread_mutex_unlock(&pool.mMutex);
+  return NULL;
+}
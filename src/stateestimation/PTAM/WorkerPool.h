@@ -0,0 +1,50 @@
+// -*- c++ -*-
+//
+// WorkerPool.h
+//
+// A small pool of persistent worker threads, used to split up
+// image processing work (e.g. the corner detection of a keyframe)
+// into jobs which run in parallel.
+//
+// Run() hands a batch of jobs to the pool and returns once all of them
+// have been run. The calling thread works on its own batch as well, so
+// a pool with zero threads simply runs the jobs one after the other.
+// Several threads may call Run() at the same time; their batches are
+// worked on in order of submission.
+
+#ifndef __WORKERPOOL_H
+#define __WORKERPOOL_H
+#include <cvd/runnable.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+
+class WorkerPool
+{
+public:
+  WorkerPool(int nThreads);
+  ~WorkerPool();
+  
+  void Run(std::vector<CVD::Runnable*> &vpJobs);   // Blocks until all jobs are done
+  inline int NumThreads() { return (int) mvThreads.size(); }
+  
+protected:
+  struct Batch
+  {
+    std::vector<CVD::Runnable*> *pvpJobs;
+    unsigned int nNext;          // Next job to be handed out
+    unsigned int nUnfinished;    // Jobs handed out or waiting, but not yet finished
+  };
+  
+  CVD::Runnable *TakeJob(Batch *pBatch);   // Needs mMutex to be held
+  static void *WorkerMain(void *pPool);
+  
+  std::vector<pthread_t> mvThreads;
+  std::deque<Batch*> mqBatches;    // Batches with jobs still waiting to be handed out
+  bool mbStop;
+  pthread_mutex_t mMutex;
+  pthread_cond_t mcondWork;        // Signalled when a batch is added, or on shutdown
+  pthread_cond_t mcondDone;        // Signalled when a batch's last job has finished
+};
+
+#endif
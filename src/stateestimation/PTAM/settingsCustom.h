@@ -59,6 +59,31 @@
 #define TRACKER_M_ESTIMATOR_DEFAULT "Tukey"		// choices are Tukey, Cauchy, Huber
 #define TRACKER_ROTATION_ESTIMATOR_BLUR 0.75
 
+// early termination of the tracker's gauss-newton pose iterations.
+// if disabled, always the full TRACKER_POSE_MAX_ITERATIONS_DEFAULT (10) iterations are done (original behaviour).
+#define TRACKER_POSE_EARLY_STOP_DEFAULT 0
+#define TRACKER_POSE_MIN_ITERATIONS_DEFAULT 3
+#define TRACKER_POSE_MAX_ITERATIONS_DEFAULT 10
+#define TRACKER_POSE_UPDATE_SQUARED_CONV_LIMIT 1e-010	// squared norm of the se3 pose update
+#define TRACKER_POSE_ERROR_DECREASE_CONV_LIMIT 0.001	// relative decrease of the mean squared reprojection error
+
+// per-point search radii from the uncertainty of the filter's pose prediction.
+// if disabled, the fixed Tracker.CoarseRange / fine ranges are used (original behaviour).
+#define TRACKER_ADAPTIVE_SEARCH_DEFAULT 0
+#define TRACKER_ADAPTIVE_SEARCH_SIGMAS_DEFAULT 3.0	// search radius in std. deviations of the predicted image position
+#define TRACKER_ADAPTIVE_SEARCH_MIN_RANGE_DEFAULT 4	// in level-0 pixels
+#define TRACKER_ADAPTIVE_SEARCH_MAX_SCALE_DEFAULT 2.0	// max. radius, relative to the fixed range of the stage
+
+// selection of the fine stage's patches if there are more than Tracker.MaxPatchesPerFrame.
+// 0: random (original behaviour), 1: spread over an image grid, preferring high levels and reliable points.
+#define TRACKER_FINE_GRID_SELECTION_DEFAULT 0
+#define TRACKER_FINE_GRID_CELL_SIZE_DEFAULT 40	// in level-0 pixels
+
+// inter-frame rotation from navdata attitude instead of the SBI alignment.
+// the SBI alignment is still done if there is no (or implausible) navdata for a frame.
+#define TRACKER_ROTATION_PRIOR_DEFAULT 0
+#define TRACKER_ROTATION_PRIOR_MAX_ANGLE_DEFAULT 0.5	// in rad per frame; larger rotations are deemed inconsistent
+
 
 #define BUNDLE_MAX_ITERATIONS 20
 #define BUNDLE_UPDATE_SQUARED_CONV_LIMIT 1e-006
@@ -66,4 +91,36 @@
 #define BUNDLE_MIN_TUKEY_SIGMA 0.4
 #define BUNDLE_M_ESTIMATOR "Tukey"		// choices are Tukey, Cauchy, Huber
 
-#define MAPMAKER_MIN_SHI_THOMASI_SCORE 70
\ No newline at end of file
+#define MAPMAKER_MIN_SHI_THOMASI_SCORE 70
+
+// worker threads for the corner detection / candidate scoring of new keyframes.
+// 0: everything is done in the calling thread (original behaviour).
+#define KEYFRAME_WORKER_THREADS_DEFAULT 0
+
+// worker threads of the mapmaker's own, for its new keyframes and re-finding.
+// 0: everything is done in the mapmaker thread.
+#define MAPMAKER_WORKER_THREADS_DEFAULT 0
+
+// at most this many idle image buffers of each size are kept for re-use (see ImagePool.h).
+#define IMAGE_POOL_MAX_PER_SIZE_DEFAULT 16
+
+// the mapmaker keeps the pyramid images of keyframes which haven't been used for
+// this many seconds compressed, to save memory on long flights. 0: never.
+#define MAPMAKER_COLD_KEYFRAME_SECONDS_DEFAULT 0
+
+// 1: the tracker's frames also get integral images of each level, so that the coarse
+// patch search only computes the cross term of each ZMSSD. 0: off (original behaviour).
+#define KEYFRAME_INTEGRAL_IMAGES_DEFAULT 0
+
+// the tracker re-uses a point's warped search template from the previous frame while its
+// warping matrix has changed by at most this much (per column; 0.07 is roughly half a
+// source pixel). 0: re-generate whenever the warp changed at all.
+#define TRACKER_TEMPLATE_WARP_TOLERANCE_DEFAULT 0.07
+
+// 1: the tracker's status message also shows how many search templates it re-generated
+// in the last frame, out of all it made or re-used (" Tmpl: rebuilt/total"). 0: off.
+#define TRACKER_REPORT_TEMPLATE_STATS_DEFAULT 0
+
+// an idle mapmaker thread sleeps until it gets a keyframe, reset or command, or at most
+// this many seconds; it then re-checks the time-based jobs (cold keyframes, bad points.)
+#define MAPMAKER_IDLE_WAKE_SECONDS_DEFAULT 0.5
\ No newline at end of file
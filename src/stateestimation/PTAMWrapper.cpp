@@ -72,6 +72,7 @@ PTAMWrapper::PTAMWrapper(DroneKalmanFilter* f, EstimationNode* nde)
 	minKFTimeDist = 0;
 
 	maxKF = 60;
+	lastFrameAttitudeValid = false;
 }
 
 void PTAMWrapper::ResetInternal()
@@ -79,9 +80,10 @@ void PTAMWrapper::ResetInternal()
 	mimFrameBW.resize(CVD::ImageRef(frameWidth, frameHeight));
 
 
+	// the tracker reads the map until it's deleted, and so does the mapmaker's thread: map goes last.
+	if(mpTracker != 0) delete mpTracker;
 	if(mpMapMaker != 0) delete mpMapMaker;
 	if(mpMap != 0) delete mpMap;
-	if(mpTracker != 0) delete mpTracker;
 	if(mpCamera != 0) delete mpCamera;
 
 
@@ -125,6 +127,7 @@ void PTAMWrapper::ResetInternal()
 	lockNextFrame = false;
 	PTAMInitializedClock = 0;
 	lastPTAMMessage = "";
+	lastFrameAttitudeValid = false;
 
 	node->publishCommand("u l PTAM has been reset.");
 }
@@ -145,10 +148,10 @@ void PTAMWrapper::setPTAMPars(double minKFTimeDist, double minKFWiggleDist, doub
 
 PTAMWrapper::~PTAMWrapper(void)
 {
-	if(mpCamera != 0) delete mpCamera;
-	if(mpMap != 0) delete mpMap;
-	if(mpMapMaker != 0) delete mpMapMaker;
 	if(mpTracker != 0) delete mpTracker;
+	if(mpMapMaker != 0) delete mpMapMaker;
+	if(mpMap != 0) delete mpMap;
+	if(mpCamera != 0) delete mpCamera;
 	if(predConvert != 0) delete predConvert;
 	if(predIMUOnlyForScale != 0) delete predIMUOnlyForScale;
 	if(imuOnlyPred != 0) delete imuOnlyPred;
@@ -244,7 +247,9 @@ void PTAMWrapper::HandleFrame()
 	// --------------------------- ROLL FORWARD TIL FRAME. This is ONLY done here. ---------------------------
 	pthread_mutex_lock( &filter->filter_CS );
 	//filter->predictUpTo(mimFrameTime,true, true);
-	TooN::Vector<10> filterPosePrePTAM = filter->getPoseAtAsVec(mimFrameTime-filter->delayVideo,true);
+	TooN::Vector<6> filterVarPrePTAM;
+	TooN::Vector<10> filterPosePrePTAM = filter->getPoseAndVarianceAtAsVec(mimFrameTime-filter->delayVideo,filterVarPrePTAM,true);
+	TooN::Vector<3> filterScales = filter->getCurrentScales();
 	pthread_mutex_unlock( &filter->filter_CS );
 
 	// ------------------------ do PTAM -------------------------
@@ -264,6 +269,29 @@ void PTAMWrapper::HandleFrame()
 
 	// set
 	mpTracker->setPredictedCamFromW(PTAMPoseGuessSE3);
+
+	// uncertainty of that guess. with Tracker.AdaptiveSearch, the tracker starts from the guess
+	// (instead of its motion model) and sizes its search radii by this.
+	// translation: metric -> PTAM scale, rotation: degrees -> radians.
+	double transSigma = std::max(sqrt(std::max(filterVarPrePTAM[0], filterVarPrePTAM[1])) / filterScales[0],
+			sqrt(filterVarPrePTAM[2]) / filterScales[2]);
+	double rotSigma = sqrt(std::max(std::max(filterVarPrePTAM[3], filterVarPrePTAM[4]), filterVarPrePTAM[5])) * 3.14159268 / 180;
+	mpTracker->setPredictedPoseSigmas(transSigma, rotSigma);
+
+	// navdata attitude at the time of this frame: relative to that of the last frame,
+	// it gives the tracker a rotation prior (used instead of the SBI alignment if enabled).
+	TooN::Vector<3> frameAttitude;
+	bool frameAttitudeValid = getNavAttitudeAt(mimFrameTime-filter->delayVideo, &frameAttitude);
+	if(frameAttitudeValid && lastFrameAttitudeValid)
+	{
+		predConvert->setPosRPY(0,0,0,lastFrameAttitude[0],lastFrameAttitude[1],lastFrameAttitude[2]);
+		TooN::SO3<> lastCamFromW = (predConvert->droneToFrontNT * predConvert->globaltoDrone).get_rotation();
+		predConvert->setPosRPY(0,0,0,frameAttitude[0],frameAttitude[1],frameAttitude[2]);
+		TooN::SO3<> camFromW = (predConvert->droneToFrontNT * predConvert->globaltoDrone).get_rotation();
+		mpTracker->setRotationPrior(camFromW * lastCamFromW.inverse());
+	}
+	lastFrameAttitude = frameAttitude;
+	lastFrameAttitudeValid = frameAttitudeValid;
 	//mpTracker->setLastFrameLost((isGoodCount < -10), (videoFrameID%2 != 0));
 	mpTracker->setLastFrameLost((isGoodCount < -20), (mimFrameSEQ%3 == 0));
 
@@ -466,7 +494,7 @@ void PTAMWrapper::HandleFrame()
 
 
 	// ----------------------------- Take KF? -----------------------------------
-	if(!mapLocked && isVeryGood && (forceKF || mpMap->vpKeyFrames.size() < maxKF || maxKF <= 1))
+	if(!mapLocked && isVeryGood && (forceKF || mpTracker->GetMapSnapshot().vKeyFrames.size() < maxKF || maxKF <= 1))
 	{
 		mpTracker->TakeKF(forceKF);
 		forceKF = false;
@@ -540,9 +568,10 @@ void PTAMWrapper::HandleFrame()
 		pthread_mutex_lock(&shallowMapCS);
 		mapPointsTransformed.clear();
 		keyFramesTransformed.clear();
-		for(unsigned int i=0;i<mpMap->vpKeyFrames.size();i++)
+		const MapSnapshot &mapSnapshot = mpTracker->GetMapSnapshot();	// the map as the tracker saw it this frame; the mapmaker may be changing the real one.
+		for(unsigned int i=0;i<mapSnapshot.vKeyFrames.size();i++)
 		{
-			predConvert->setPosSE3_globalToDrone(predConvert->frontToDroneNT * mpMap->vpKeyFrames[i]->se3CfromW);
+			predConvert->setPosSE3_globalToDrone(predConvert->frontToDroneNT * mapSnapshot.vKeyFrames[i].se3CfromW);
 			TooN::Vector<6> CamPos = TooN::makeVector(predConvert->x, predConvert->y, predConvert->z, predConvert->roll, predConvert->pitch, predConvert->yaw);
 			CamPos = filter->transformPTAMObservation(CamPos);
 			predConvert->setPosRPY(CamPos[0], CamPos[1], CamPos[2], CamPos[3], CamPos[4], CamPos[5]);
@@ -550,9 +579,9 @@ void PTAMWrapper::HandleFrame()
 		}
 		TooN::Vector<3> PTAMScales = filter->getCurrentScales();
 		TooN::Vector<3> PTAMOffsets = filter->getCurrentOffsets().slice<0,3>();
-		for(unsigned int i=0;i<mpMap->vpPoints.size();i++)
+		for(unsigned int i=0;i<mapSnapshot.vPoints.size();i++)
 		{
-			TooN::Vector<3> pos = (mpMap->vpPoints)[i]->v3WorldPos;
+			TooN::Vector<3> pos = mapSnapshot.vPoints[i].v3WorldPos;
 			pos[0] *= PTAMScales[0];
 			pos[1] *= PTAMScales[1];
 			pos[2] *= PTAMScales[2];
@@ -801,6 +830,33 @@ TooN::Vector<3> PTAMWrapper::evalNavQue(unsigned int from, unsigned int to, bool
 	return TooN::makeVector(predIMUOnlyForScale->x,predIMUOnlyForScale->y,predIMUOnlyForScale->z);
 }
 
+// interpolates the raw navdata attitude at timestamp.
+// fails if there is no navdata shortly before and after it.
+bool PTAMWrapper::getNavAttitudeAt(int timestamp, TooN::Vector<3>* rpy)
+{
+	bool found = false;
+	pthread_mutex_lock(&navInfoQueueCS);
+	for(unsigned int i=1;i<navAttitudeQueue.size();i++)
+	{
+		const TooN::Vector<4>& before = navAttitudeQueue[i-1];
+		const TooN::Vector<4>& after = navAttitudeQueue[i];
+		if(after[0] < timestamp) continue;
+		if(before[0] > timestamp || after[0] - before[0] > 50) break;
+
+		double a = (after[0] > before[0]) ? (timestamp - before[0]) / (after[0] - before[0]) : 0;
+		double yawDiff = after[3] - before[3];
+		while(yawDiff > 180) yawDiff -= 360;
+		while(yawDiff < -180) yawDiff += 360;
+		*rpy = TooN::makeVector(before[1] + a * (after[1] - before[1]),
+				before[2] + a * (after[2] - before[2]),
+				before[3] + a * yawDiff);
+		found = true;
+		break;
+	}
+	pthread_mutex_unlock(&navInfoQueueCS);
+	return found;
+}
+
 void PTAMWrapper::newNavdata(ardrone_autonomy::Navdata* nav)
 {
 	lastNavinfoReceived = *nav;
@@ -822,6 +878,11 @@ void PTAMWrapper::newNavdata(ardrone_autonomy::Navdata* nav)
 	pthread_mutex_lock( &navInfoQueueCS );
 	navInfoQueue.push_back(lastNavinfoReceived);
 
+	// uncorrected attitude, last second only.
+	navAttitudeQueue.push_back(TooN::makeVector(getMS(nav->header.stamp), nav->rotX, nav->rotY, nav->rotZ));
+	if(navAttitudeQueue.size() > 200)
+		navAttitudeQueue.pop_front();
+
 	if(navInfoQueue.size() > 1000)	// respective 5s
 	{
 		navInfoQueue.pop_front();
@@ -115,6 +115,13 @@ private:
 	std::deque<ardrone_autonomy::Navdata> navInfoQueue;
 	bool navQueueOverflown;
 	TooN::Vector<3> evalNavQue(unsigned int from, unsigned int to, bool* zCorrupted, bool* allCorrupted);
+
+	// raw navdata attitude as (timestamp, roll, pitch, yaw), for the tracker's rotation prior.
+	// protected by navInfoQueueCS as well.
+	std::deque<TooN::Vector<4> > navAttitudeQueue;
+	bool getNavAttitudeAt(int timestamp, TooN::Vector<3>* rpy);
+	TooN::Vector<3> lastFrameAttitude;
+	bool lastFrameAttitudeValid;
 	
 
 	// keep Running
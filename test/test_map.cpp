@@ -0,0 +1,168 @@
+// Stress test of the Map's snapshots and their epoch-based reclamation: one writer adds,
+// moves, trashes and resets, publishing as it goes, while three readers hold snapshots.
+// Everything the map deletes is scribbled over first (see operator delete below), so a
+// reader which can still see a freed snapshot, point or keyframe reads garbage, and the
+// test fails. It is also worth running built with -fsanitize=thread.
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include "../src/stateestimation/PTAM/Map.h"
+#include "../src/stateestimation/PTAM/MapPoint.h"
+#include "../src/stateestimation/PTAM/KeyFrame.h"
+
+using namespace TooN;
+
+void operator delete(void *p) throw()
+{
+  if(p == NULL)
+    return;
+  memset(p, 0xdd, malloc_usable_size(p));
+  free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+  operator delete(p);
+}
+
+#define NUM_READERS 3
+
+static Map *gpMap;
+static volatile int gnStop;
+static volatile int gnErrors;
+static long galReads[NUM_READERS];
+
+// Counts an error, and says what it was the first time.
+static void ReaderError(const char *szWhat)
+{
+  if(__sync_fetch_and_add(&gnErrors, 1) == 0)
+    fprintf(stderr, "reader saw %s\n", szWhat);
+}
+
+// The writer only ever gives points and keyframes values which pass these checks;
+// freed memory doesn't.
+static void CheckSnapshot(const MapSnapshot &S)
+{
+  for(unsigned int i=0; i<S.vPoints.size(); i++)
+    {
+      const MapSnapshot::Point &p = S.vPoints[i];
+      double d = p.v3WorldPos[0];
+      if(!(d >= 0.0 && d < 1000.0) || p.v3PixelRight_W[0] != d || p.v3PixelDown_W[1] != d)
+	ReaderError("a bad snapshot point");
+      if(p.pPoint->nSourceLevel != 1 || p.pPoint->irCenter != CVD::ImageRef(3,4))
+	ReaderError("a bad map point");
+    }
+  for(unsigned int i=0; i<S.vKeyFrames.size(); i++)
+    {
+      const MapSnapshot::KeyFrameEntry &k = S.vKeyFrames[i];
+      if(k.v3CamPos[0] != -k.se3CfromW.get_translation()[0])
+	ReaderError("a bad snapshot keyframe");
+      if(k.pKF->dSceneDepthMean != 1.0)
+	ReaderError("a bad keyframe");
+    }
+  if(S.vKeyFrames.size() > 0 && !(S.DistToNearestKeyFrame(makeVector(0.0, 0.0, 0.0)) >= 0.0))
+    ReaderError("a bad keyframe tree");
+}
+
+static void *Reader(void *pv)
+{
+  long n = (long) pv;
+  int nSlot = gpMap->RegisterReader();
+  unsigned int nSeed = n;
+  while(!__sync_fetch_and_add(&gnStop, 0))
+    {
+      const MapSnapshot &S = gpMap->BeginRead(nSlot);
+      CheckSnapshot(S);
+      if(rand_r(&nSeed) % 4 == 0)
+	{ // Hold the snapshot for a while, like the tracker does for a frame, and look again.
+	  usleep(100);
+	  CheckSnapshot(S);
+	}
+      gpMap->EndRead(nSlot);
+      __sync_fetch_and_add(&galReads[n], 1);
+    }
+  return NULL;
+}
+
+TEST(Map, ReadersNeverSeeReclaimedGarbage)
+{
+  gpMap = new Map;
+  gnStop = gnErrors = 0;
+  pthread_t athreads[NUM_READERS];
+  for(long i=0; i<NUM_READERS; i++)
+    pthread_create(&athreads[i], NULL, Reader, (void*) i);
+
+  // Start once every reader is reading, and give them time to read now and then.
+  for(int i=0; i<NUM_READERS; i++)
+    while(__sync_fetch_and_add(&galReads[i], 0) == 0)
+      usleep(100);
+  srand(1);
+  for(int nIt = 0; nIt < 20000; nIt++)
+    {
+      if(nIt % 10 == 0)
+	usleep(20);
+      Map &m = *gpMap;
+      int r = rand() % 100;
+      if(r < 40)
+	{ // New points, and now and then a keyframe.
+	  MapPoint *p = new MapPoint;
+	  p->nSourceLevel = 1;
+	  p->irCenter = CVD::ImageRef(3,4);
+	  p->v3WorldPos = p->v3PixelRight_W = makeVector(1.0, 0.0, 0.0);
+	  p->v3PixelDown_W = makeVector(0.0, 1.0, 0.0);
+	  m.vpPoints.push_back(p);
+	  if(rand() % 8 == 0)
+	    {
+	      KeyFrame *pK = new KeyFrame;
+	      pK->bFixed = false;
+	      pK->dSceneDepthMean = 1.0;
+	      pK->se3CfromW = SE3<>::exp(makeVector(rand() % 10, 0, 0, 0, 0, 0));
+	      m.vpKeyFrames.push_back(pK);
+	    }
+	  m.Publish();
+	}
+      else if(r < 70)
+	{ // A bundle adjustment: move everything, then publish the lot at once.
+	  double d = rand() % 1000;
+	  for(unsigned int i=0; i<m.vpPoints.size(); i++)
+	    {
+	      m.vpPoints[i]->v3WorldPos[0] = d;
+	      m.vpPoints[i]->v3PixelRight_W[0] = d;
+	      m.vpPoints[i]->v3PixelDown_W[1] = d;
+	    }
+	  for(unsigned int i=0; i<m.vpKeyFrames.size(); i++)
+	    m.vpKeyFrames[i]->se3CfromW = SE3<>::exp(makeVector(d, 0, 0, 0, 0, 0));
+	  m.Publish();
+	}
+      else if(r < 97)
+	{
+	  for(unsigned int i=0; i<m.vpPoints.size(); i++)
+	    if(rand() % 3 == 0)
+	      m.vpPoints[i]->bBad = true;
+	  m.MoveBadPointsToTrash();
+	}
+      else
+	m.Reset();
+      m.ReclaimGarbage(m.MinReaderEpoch());
+    }
+  __sync_lock_test_and_set(&gnStop, 1);
+  for(int i=0; i<NUM_READERS; i++)
+    pthread_join(athreads[i], NULL);
+
+  EXPECT_EQ(0, gnErrors);
+
+  // With the readers gone, everything can go.
+  gpMap->ReclaimGarbage(gpMap->MinReaderEpoch());
+  EXPECT_EQ(0u, gpMap->vpPointsTrash.size());
+  delete gpMap;
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,192 @@
+// Checks that the coarse search scores agree, whichever code path makes them:
+// PatchFinder::ZMSSDAtPoints (which does two locations at once with AVX2, on CPUs
+// which have it), the one-location PatchFinder::ZMSSDAtPoint (SSE for 8x8 patches,
+// plain C++ otherwise), its integral image version, and a plain ZMSSD written out here.
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <vector>
+#include <cvd/image.h>
+#include <gvars3/instances.h>
+#include "../src/stateestimation/PTAM/PatchFinder.h"
+#include "../src/stateestimation/PTAM/KeyFrame.h"
+
+using namespace CVD;
+using namespace GVars3;
+using namespace std;
+
+// Gives the test the template, to score against by hand.
+class TestPatchFinder : public PatchFinder
+{
+public:
+  TestPatchFinder(int nPatchSize) : PatchFinder(nPatchSize) {}
+  Image<byte> &Template() { return mimTemplate; }
+};
+
+// Zero-mean SSD of the template at ir, the slow and obvious way.
+static int PlainZMSSD(TestPatchFinder &Finder, BasicImage<byte> &im, ImageRef ir, int nPatchSize)
+{
+  ImageRef irCenter(nPatchSize / 2, nPatchSize / 2);
+  if(!im.in_image_with_border(ir, irCenter.x))
+    return Finder.mnMaxSSD + 1;
+  int nSumA = 0, nSumB = 0, nSumSqA = 0, nSumSqB = 0, nCross = 0;
+  for(int y=0; y<nPatchSize; y++)
+    for(int x=0; x<nPatchSize; x++)
+      {
+	int a = Finder.Template()[y][x];
+	int b = im[ir - irCenter + ImageRef(x,y)];
+	nSumA += a;
+	nSumB += b;
+	nSumSqA += a * a;
+	nSumSqB += b * b;
+	nCross += a * b;
+      }
+  int N = nPatchSize * nPatchSize;
+  return (2*nSumA*nSumB - nSumA*nSumA - nSumB*nSumB)/N + nSumSqB + nSumSqA - 2*nCross;
+}
+
+// The first of the lowest scores: what FindPatchCoarse would pick.
+static int BestIndex(const vector<int> &vnScores)
+{
+  int nBest = 0;
+  for(unsigned int i=1; i<vnScores.size(); i++)
+    if(vnScores[i] < vnScores[nBest])
+      nBest = i;
+  return nBest;
+}
+
+// A keyframe made from a random image, with or without integral images.
+static void MakeRandomKeyFrame(KeyFrame &kf, bool bIntegrals)
+{
+  Image<byte> im(ImageRef(640, 480));
+  for(int y=0; y<im.size().y; y++)
+    for(int x=0; x<im.size().x; x++)
+      im[y][x] = rand() % 256;
+  GV3::get<int>("KeyFrame.IntegralImages", 0, SILENT) = bIntegrals ? 1 : 0;
+  kf.MakeKeyFrame_Lite(im);
+}
+
+// Search locations all over a level: random ones, ones on and next to the edge of the area
+// where a whole patch fits, and ones outside the image. An even number of them, so that
+// with the template's own location there's an odd number, and the AVX2 path has a location
+// without a partner.
+static vector<ImageRef> MakeCandidates(ImageRef irSize, int nBorder)
+{
+  vector<ImageRef> vir;
+  for(int i=0; i<200; i++)
+    vir.push_back(ImageRef(rand() % (irSize.x + 4) - 2, rand() % (irSize.y + 4) - 2));
+  for(int d = nBorder - 1; d <= nBorder + 1; d++)
+    {
+      vir.push_back(ImageRef(d, rand() % irSize.y));
+      vir.push_back(ImageRef(irSize.x - 1 - d, rand() % irSize.y));
+      vir.push_back(ImageRef(rand() % irSize.x, d));
+      vir.push_back(ImageRef(rand() % irSize.x, irSize.y - 1 - d));
+      vir.push_back(ImageRef(d, d));
+      vir.push_back(irSize - ImageRef(1 + d, 1 + d));
+    }
+  vir.push_back(ImageRef(-100, 5));
+  if(vir.size() % 2 == 1)
+    vir.push_back(ImageRef(irSize.x / 2, irSize.y / 2));
+  return vir;
+}
+
+// Makes a template from the middle location of vir, scores all of vir every way
+// there is, and checks they all agree.
+static void CheckAllPathsAgree(KeyFrame &kf, int nLevel, int nPatchSize, vector<ImageRef> vir)
+{
+  Level &L = kf.aLevels[nLevel];
+  ImageRef irTemplatePos = vir[vir.size() / 2];
+  TestPatchFinder Finder(nPatchSize);
+  Finder.MakeTemplateCoarseNoWarp(kf, nLevel, irTemplatePos);
+  ASSERT_FALSE(Finder.TemplateBad());
+
+  vector<int> vnBatch;
+  Finder.ZMSSDAtPoints(L, vir, vnBatch);
+  ASSERT_EQ(vir.size(), vnBatch.size());
+
+  vector<int> vnLevel(vir.size()), vnImage(vir.size()), vnPlain(vir.size());
+  for(unsigned int i=0; i<vir.size(); i++)
+    {
+      vnLevel[i] = Finder.ZMSSDAtPoint(L, vir[i]);
+      vnImage[i] = Finder.ZMSSDAtPoint(L.im, vir[i]);
+      vnPlain[i] = PlainZMSSD(Finder, L.im, vir[i], nPatchSize);
+      EXPECT_EQ(vnPlain[i], vnBatch[i]) << "batch score at " << vir[i];
+      EXPECT_EQ(vnPlain[i], vnLevel[i]) << "level score at " << vir[i];
+      EXPECT_EQ(vnPlain[i], vnImage[i]) << "image score at " << vir[i];
+    }
+
+  int nBest = BestIndex(vnPlain);
+  EXPECT_EQ(nBest, BestIndex(vnBatch));
+  EXPECT_EQ(nBest, BestIndex(vnLevel));
+  EXPECT_EQ(nBest, BestIndex(vnImage));
+  EXPECT_EQ(0, vnPlain[nBest]);  // The template's own location is in there.
+}
+
+// A template location in the middle of a level, away from the edges.
+static vector<ImageRef> CandidatesForLevel(KeyFrame &kf, int nLevel, int nPatchSize)
+{
+  ImageRef irSize = kf.aLevels[nLevel].im.size();
+  ImageRef irTemplatePos(irSize.x / 3 + rand() % (irSize.x / 3), irSize.y / 3 + rand() % (irSize.y / 3));
+  vector<ImageRef> vir = MakeCandidates(irSize, nPatchSize / 2);
+  vir.insert(vir.begin() + vir.size() / 2, irTemplatePos);   // CheckAllPathsAgree takes the template from the middle one.
+  return vir;
+}
+
+TEST(PatchFinder, BatchScoresMatchWithIntegralImages)
+{
+  srand(1);
+  KeyFrame kf;
+  MakeRandomKeyFrame(kf, true);
+  ASSERT_TRUE(kf.aLevels[0].bIntegralsMade);
+  for(int nLevel=0; nLevel<LEVELS; nLevel++)
+    for(int nRun=0; nRun<5; nRun++)
+      CheckAllPathsAgree(kf, nLevel, 8, CandidatesForLevel(kf, nLevel, 8));
+  kf.ReleaseImages();
+}
+
+TEST(PatchFinder, BatchScoresMatchWithoutIntegralImages)
+{
+  srand(2);
+  KeyFrame kf;
+  MakeRandomKeyFrame(kf, false);
+  ASSERT_FALSE(kf.aLevels[0].bIntegralsMade);
+  for(int nLevel=0; nLevel<LEVELS; nLevel++)
+    for(int nRun=0; nRun<5; nRun++)
+      CheckAllPathsAgree(kf, nLevel, 8, CandidatesForLevel(kf, nLevel, 8));
+  kf.ReleaseImages();
+}
+
+// Patches other than 8x8 don't have SSE or AVX2 code; the general C++ is used throughout.
+TEST(PatchFinder, BatchScoresMatchOtherPatchSizes)
+{
+  srand(3);
+  KeyFrame kf;
+  MakeRandomKeyFrame(kf, true);
+  for(int nPatchSize=6; nPatchSize<=10; nPatchSize+=2)
+    if(nPatchSize != 8)
+      CheckAllPathsAgree(kf, 0, nPatchSize, CandidatesForLevel(kf, 0, nPatchSize));
+  kf.ReleaseImages();
+}
+
+// One and three locations: a batch of one isn't batched at all, and three leave
+// the AVX2 path one location without a partner.
+TEST(PatchFinder, SmallBatches)
+{
+  srand(4);
+  KeyFrame kf;
+  MakeRandomKeyFrame(kf, true);
+  ImageRef irSize = kf.aLevels[0].im.size();
+  vector<ImageRef> vir(1, irSize / 2);
+  CheckAllPathsAgree(kf, 0, 8, vir);
+  vir.clear();
+  vir.push_back(ImageRef(3, 100));
+  vir.push_back(irSize / 2);
+  vir.push_back(irSize - ImageRef(4, 4));
+  CheckAllPathsAgree(kf, 0, 8, vir);
+  kf.ReleaseImages();
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}